@@ -37,10 +37,14 @@ void help()
         "     <w> <h>              Size of screen border in pixels. Can be used to achieve equal sized patches for averaging." << endl << 
         "     <size>               Size of square patches to average over; in pixels" <<  endl <<
         "     <mode>               Program mode" <<  endl <<
-        "     <out_response>       File for dumping the response curve." <<  endl << 
+        "     <out_response>       File for dumping the response curve; binary SVR file if the name ends with .svrb" <<  endl << 
         "     <cs_matrix>          Colorspace transformation matrices (created with --color_patches)." <<  endl << 
         "     <in1> <in2> .. <inN> Input Images: screen showing uniform grey of different values; assumes equal spaced values ranging from 0 .. 1" <<  endl <<
         endl <<
+        " " << PROGNAME << " --svr_convert <in_response> <out_response>" << endl <<
+        "     <in_response>        SVR response in YAML format (created with --svr 0)." <<  endl <<
+        "     <out_response>       Binary SVR file (.svrb) for fast loading." <<  endl <<
+        endl <<
         " " << PROGNAME << " --average <in_response1> <in_response2> ... <in_responsen> <out_response>" << endl <<
         "     <in_response#>       Response curves (4-column) that should be averaged." <<  endl <<
         "     <out_response>       file to dump averaged response curve to." <<  endl <<
@@ -85,9 +89,11 @@ inline double fit_in_range (double val, double minVal, double maxVal) {
 
 vector<Vec3f>& fit_in_range ( vector<Vec3f>& curve, Vec3f minVal, Vec3f maxVal)
 {
-    for (int i=0; i<curve.size(); i++)
-        for (int c=0; c<3; c++)
-            curve[i][c] = fit_in_range (curve[i][c], minVal[c], maxVal[c]);
+    for (int c=0; c<3; c++) {
+        float invRange = 1.0 / (maxVal[c] - minVal[c]);
+        for (int i=0; i<curve.size(); i++)
+            curve[i][c] = (curve[i][c] - minVal[c]) * invRange;
+    }
             
     return curve;
 }
@@ -486,8 +492,23 @@ int run_svr(int argc, char* argv[])
     int num = pow(2,12);
     vector<Vec3f> inverted(num);
     
+    // dump inverted response to binary svr file
+    bool binary = outfile.size() > 5 && outfile.compare(outfile.size()-5, 5, ".svrb") == 0;
+    if (mode == 0 && binary) {
+        cout << "dumping inverted response curve to " << outfile << endl;
+        int numPatches = numx * numy;
+        vector<Vec3f> minVals (numPatches), maxVals (numPatches);
+        vector<vector<Vec3f> > responses (numPatches);
+        for (int n=0;n<numPatches;n++){
+            minVals[n] = svr[n][0];
+            maxVals[n] = svr[n][numSamples-1];
+            responses[n] = invert_response(svr[n], inverted);
+        }
+        SVRFileHeader header = svr_file_header (imgs[0].size(), Size(bw, bh), Size(numx, numy), patchSize);
+        if (not write_svr_file (outfile, header, minVals, maxVals, responses)) return -1;
+    
     // dump inverted response to yml file
-    if (mode == 0) {
+    } else if (mode == 0) {
         cout << "dumping inverted response curve to " << outfile << endl;
         FileStorage fs(outfile.c_str(), FileStorage::WRITE);
         String type = "svr";
@@ -824,6 +845,32 @@ int run_color_patches (int argc, char* argv[])
     
 }
 
+/**
+  Convert an SVR response from YAML to the binary SVR format
+*/
+int run_svr_convert(int argc, char* argv[])
+{
+    cout << "loading " << argv[2] << " " << flush;
+    FileStorage fs (argv[2], FileStorage::READ);
+    if (not fs.isOpened()) {
+        cout << "Error: cannot open " << argv[2] << endl;
+        return -1;
+    }
+    
+    SVRFileHeader header;
+    vector<Vec3f> minVals, maxVals;
+    vector<vector<Vec3f> > responses;
+    bool ok = read_svr_yaml (fs, header, minVals, maxVals, responses);
+    fs.release();
+    if (not ok) return -1;
+    cout << " done." << endl;
+    
+    cout << "writing " << header.numPatches << " response curves to " << argv[3] << endl;
+    if (not write_svr_file (argv[3], header, minVals, maxVals, responses)) return -1;
+    
+    return 0;
+}
+
 /**
   Main: evaluate first argument and call required method with the arguments
 */
@@ -831,7 +878,7 @@ int main(int argc, char *argv[])
 {
     cout << PROGNAME << " started" << endl;
 
-    enum MODE {NONE, BGLIGHT, RESPONSE, SVR, AVERAGE, COLOR, COLORPATCHES};
+    enum MODE {NONE, BGLIGHT, RESPONSE, SVR, SVRCONVERT, AVERAGE, COLOR, COLORPATCHES};
     MODE mode = NONE;
 
     if (argc < 2) {
@@ -843,6 +890,8 @@ int main(int argc, char *argv[])
         mode = RESPONSE;
     } else if ( (strcmp( argv[1], "--svr" ) == 0) && (argc >= 9)) {
         mode = SVR;
+    } else if ( (strcmp( argv[1], "--svr_convert" ) == 0) && (argc >= 4)) {
+        mode = SVRCONVERT;
     } else if ( (strcmp( argv[1], "--average" ) == 0) && (argc >= 5)) {
         mode = AVERAGE;
     } else if ( (strcmp( argv[1], "--color" ) == 0) && (argc >= 6)) {
@@ -865,6 +914,10 @@ int main(int argc, char *argv[])
             result = run_svr(argc, argv);
             break;
             
+        case SVRCONVERT:
+            result = run_svr_convert(argc, argv);
+            break;
+            
         case AVERAGE:
             result =  run_average(argc, argv);
             break;
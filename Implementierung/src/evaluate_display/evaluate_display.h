@@ -11,5 +11,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <fstream>
+
+#include "svrfile.h"
 
 #endif //  DISPLAY_CONTROL_H
@@ -72,6 +72,11 @@ CubeMap::CubeMap (Mat& _envMap,
     cout << " done!" << endl;
    // imwrite("tmp/minLight.exr", minLight);
     
+    // bake patch indices and interpolation weights for the response lookup
+    cout << "precomputing response lookup table ..." << flush;
+    svrTable.build(svr, screenSizePixel);
+    cout << " done!" << endl;
+    
     
     screenRequired = Mat::zeros(screenSizePixel, CV_32FC3);
     screenUsed = Mat::zeros(screenSizePixel, CV_32FC3);
@@ -129,96 +134,135 @@ Mat& CubeMap::create_cubemap (Mat& cube, Mat& spherical)
     // supersampling grid size (must be uneven)
     const int ss_grid_size = 5; 
     
-    // shortcuts         
-    const Vec3d  X = Vec3d(1,0,0);
-    const Vec3d mX = Vec3d(-1,0,0);
-    const Vec3d  Y = Vec3d(0,1,0);
-    const Vec3d mY = Vec3d(0,-1,0);
-    const Vec3d  Z = Vec3d(0,0,1);
-    const Vec3d mZ = Vec3d(0,0,-1);
-    
-    //     0    1    2    3    4    5
-    //  +------------------------------+
-    //  |  L | Ba |  R |  F |  T |  Bo |
-    //  | -X | +Y | +X | -Y | +Z | -Z  | fw-vec
-    //  |  Y |  X | -Y | -X |  X |  X  | right-vec
-    //  | -Z | -Z | -Z | -Z |  Y | -Y  | down-vec
-    //  +------------------------------+
-        
-    // array of forwardm right and down vector for each cube side
-    Vec3d forward[6] = { mX, Y, X, mY, Z, mZ };
-    Vec3d right[6] = {  Y, X, mY, mX, X, X };
-    Vec3d down[6]  = { mZ, mZ, mZ, mZ, Y, mY };
-    
-    cout << "calculating cube map from spherical environment map " << flush;
+    cout << "calculating cube map from spherical environment map ..." << flush;
+    sw_start();
     
-    // initialize 6 images
-    Mat sides[6];
-    for (int i=0; i<6; i++) {
-        sides[i] = Mat(Size(cubeSize, cubeSize), CV_32FC3);
-    }
+    // all sides are written directly into the horizontal cube map; rows of the side faces and rows of
+    // top and bottom are processed in parallel
+    cube = Mat(Size(6*cubeSize, cubeSize), CV_32FC3);
+    CubeMapConversion conversion (cube, spherical, cubeSize, ss_grid_size);
+    parallel_for_(Range(0, 2*cubeSize), conversion);
     
-    // for each cube sides do:
-    //   set up image plane vectors (forward, up, right)
-    //     for each pixel on image plane do:
-    //        for each supersampling point in pixel do:
-    //           calculate spherical coordinate
-    //           lookup value in spherical envmap
-    //        calculate average and set pixel value
+    sw_stop();
+    cout << " took " << sw_elapsed_ms() << " ms" << endl;
     
+    return cube;
+}
+
+
+/**
+   Conversion from spherical to cube map for a range of task rows: row y < cubeSize is row y of the four side faces,
+   row cubeSize + y is row y of top and bottom.
+   The supersampling positions along a side's axes are the same for all sides, and on the side faces the azimuth only
+   depends on the column, so both are precomputed once.
+*/
+CubeMapConversion::CubeMapConversion (Mat& _cube, Mat& _spherical, int _cubeSize, int _ssGridSize)
+ :cube(_cube),
+  spherical(_spherical),
+  cubeSize(_cubeSize),
+  ssGridSize(_ssGridSize)
+{
     double p_delta = 2.0 / cubeSize; // 2x pixel size
-    Matx31d ycomp;       // y-coordinate component of 3D pixel position
+    int ss_side = (ssGridSize-1)/2;  // we iterate from -ss_side  (inclusive) to +ss_side (inclusive)
+    double ss_delta = 1.0 / (double)(ssGridSize-1);  // distance between two supersampling points
+    
+    offset.resize(cubeSize * ssGridSize);
+    for (int x=0; x<cubeSize; x++) {
+        for (int s=0; s<ssGridSize; s++) {
+            offset[x*ssGridSize + s] = p_delta * ((double)x-(double)(cubeSize-1)/2.0 + (double)(s-ss_side)*ss_delta);
+        }
+    }
     
-    for (int i=0; i<6; i++) {
-        for (int y=0; y<cubeSize; y++) {
+    //     0    1    2    3
+    //  +-------------------+
+    //  |  L | Ba |  R |  F |
+    //  | -X | +Y | +X | -Y | fw-vec
+    //  |  Y |  X | -Y | -X | right-vec
+    //  +-------------------+
+    const Vec3d forward[4] = { Vec3d(-1,0,0), Vec3d(0,1,0), Vec3d(1,0,0), Vec3d(0,-1,0) };
+    const Vec3d right[4]   = { Vec3d(0,1,0),  Vec3d(1,0,0), Vec3d(0,-1,0), Vec3d(-1,0,0) };
+    for (int i=0; i<4; i++) {
+        sideX[i].resize(offset.size());
+        for (uint j=0; j<offset.size(); j++) {
+            double b = offset[j];
+            sideX[i][j] = sphericalX (atan2(forward[i][1] + right[i][1]*b, forward[i][0] + right[i][0]*b));
+        }
+    }
+}
+
+// spherical map column of azimuth theta (see cart2spher)
+int CubeMapConversion::sphericalX (double theta) const
+{
+    int width = spherical.size().width;
+    return clamp((int)(0.5 + (1-(theta/M_PI+1) / 2.0) * width - 1), 0, width);
+}
+
+// spherical map row of polar angle phi
+int CubeMapConversion::sphericalY (double phi) const
+{
+    int height = spherical.size().height;
+    return clamp((int)(0.5 + phi/M_PI * height - 1), 0, height);
+}
+
+void CubeMapConversion::operator() (const Range& rows) const
+{
+    const int n = ssGridSize;
+    const int m = cubeSize * n;             // samples along a cube map row
+    const float norm = 1.0f / (n*n);
+    vector<int> sideY (n*m);                // spherical map rows of the samples of one side face row
+    
+    for (int r=rows.start; r<rows.end; r++) {
+        int y = r % cubeSize;
+        Vec3f* row = cube.ptr<Vec3f>(y);
+        
+        if (r < cubeSize) {
+            
+            // side faces: sample position (fw + down*a + right*b) has z = -a and a horizontal distance of sqrt(1+b*b),
+            // so the polar angle is the same on all four sides
+            for (int sy=0; sy<n; sy++) {
+                double a = offset[y*n + sy];
+                for (int j=0; j<m; j++) {
+                    double b = offset[j];
+                    sideY[sy*m + j] = sphericalY (acos(-a / sqrt(1 + b*b + a*a)));
+                }
+            }
+            
+            for (int i=0; i<4; i++) {
+                const int* ex = &sideX[i][0];
+                Vec3f* out = row + i*cubeSize;
+                for (int x=0; x<cubeSize; x++) {
+                    Vec3f pixel(0,0,0); 
+                    for (int sy=0; sy<n; sy++) {
+                        const int* ey = &sideY[sy*m + x*n];
+                        for (int sx=0; sx<n; sx++) {
+                            pixel += spherical.ptr<Vec3f>(ey[sx])[ex[x*n + sx]];
+                        }
+                    }
+                    out[x] = pixel * norm;
+                }
+            }
+            
+        } else {
+            
+            // top (+Z, sample (b, a, 1)) and bottom (-Z, sample (b, -a, -1)) share the distance
+            Vec3f* top = row + 4*cubeSize;
+            Vec3f* bottom = row + 5*cubeSize;
             for (int x=0; x<cubeSize; x++) {
-                    
-                // pixel value for supersampling averaging
-                Vec3f pixel(0,0,0); 
-                
-                // supersampling grid
-                int ss_side = (ss_grid_size-1)/2;           // we iterate from -ss_side  (inclusive) to +ss_side (inclusive)
-                double ss_delta = 1.0 / (double)(ss_grid_size-1);  // distance between two supersampling points
-                for (int sy=-ss_side; sy<=ss_side; sy++) {
-                    ycomp = down[i] * p_delta * ((double)y-(double)(cubeSize-1)/2.0 + (double)sy*ss_delta);
-                    for (int sx=-ss_side; sx<=ss_side; sx++) {
-                        
-                        // 3d position in space
-                        Matx31d posCart = forward[i] + ycomp + right[i] * p_delta * ((double)x-(double)(cubeSize-1)/2.0 + (double)sx*ss_delta);
-                        
-                        // get spherical coordinates
-                        Matx31d posSpher = cart2spher(posCart);
-                        // sample spherical envmap
-                        Point2i envMapPos; 
-                        envMapPos.x =  (int)(0.5 + ( 1-(posSpher(2)/M_PI+1) / 2.0 * (float)spherical.size().width-1) );
-                        envMapPos.y =  (int)(0.5 + (  posSpher(1)/M_PI            * (float)spherical.size().height-1));
-                        pixel += spherical.ptr<Vec3f>(envMapPos.y)[envMapPos.x];
-                        //cout << i << " " << x << " " << y << " " << envMapPos << endl;
-                        
+                Vec3f pixelTop(0,0,0), pixelBottom(0,0,0);
+                for (int sy=0; sy<n; sy++) {
+                    double a = offset[y*n + sy];
+                    for (int sx=0; sx<n; sx++) {
+                        double b = offset[x*n + sx];
+                        double len = sqrt(b*b + a*a + 1);
+                        pixelTop += spherical.ptr<Vec3f>(sphericalY(acos(1 / len)))[sphericalX(atan2(a, b))];
+                        pixelBottom += spherical.ptr<Vec3f>(sphericalY(acos(-1 / len)))[sphericalX(atan2(0.0 - a, b))];
                     }
                 }
-                
-                // average supersampled values
-                pixel[0] /= ss_grid_size * ss_grid_size;
-                pixel[1] /= ss_grid_size * ss_grid_size;
-                pixel[2] /= ss_grid_size * ss_grid_size;
-                
-                // set pixel value
-                sides[i].ptr<Vec3f>(y)[x] = pixel;
+                top[x] = pixelTop * norm;
+                bottom[x] = pixelBottom * norm;
             }
         }
-        cout << "." << flush;
-    }
-    cout << " done!" << endl;
-    
-    // concatenate images horizontally
-    cube = Mat(Size(6*cubeSize, cubeSize), CV_32FC3);
-    for (int i=0; i<6; i++) {
-        Rect region (i*cubeSize, 0, cubeSize, cubeSize);
-        sides[i].copyTo (cube (region));
     }
-    
-    return cube;
 }
 
 /*
@@ -314,10 +358,114 @@ Matx31d CubeMap::get_cube_normal (Matx31d& pos)
 
 */
 
+/**
+  Band pass 1: border ramp and cos phi factor; per-band maxima for the exposure multiplier
+*/
+HDRBandPrepare::HDRBandPrepare (CubeMap& _cube, int _bandHeight, Matx31d& _screenCenter, Matx31d& _down, Matx31d& _right, bool _applyCosFactor,
+                                vector<float>& _bandMaxRequired, vector<float>& _bandMaxRatio)
+ :cube(_cube),
+  bandHeight(_bandHeight),
+  screenCenter(_screenCenter),
+  down(_down),
+  right(_right),
+  applyCosFactor(_applyCosFactor),
+  borderMask(&_cube.borderRampMask),
+  bandMaxRequired(_bandMaxRequired),
+  bandMaxRatio(_bandMaxRatio)
+{
+    screenNormal = Mat(down).cross(right);  // TODO check direction
+}
+
+void HDRBandPrepare::operator() (const Range& bands) const
+{
+    const int width = cube.screenSizePixel.width;
+    const double screenNormalLength = norm (screenNormal);
+    
+    Vec3f *ps; 
+    const Vec3f *pm, *pmax;
+    Matx31d pos;
+    
+    for (int b=bands.start; b<bands.end; b++) {
+        float maxRequired = 0.0f;
+        float maxRatio = 0.0f;
+        int yEnd = min((b+1)*bandHeight, cube.screenSizePixel.height);
+        
+        for (int y=b*bandHeight; y<yEnd; y++) {
+            ps = cube.screenRequired.ptr<Vec3f>(y);
+            pmax = cube.maxScreenRadiance.ptr<Vec3f>(y);
+            
+            // apply border ramp alhpa values 
+            if (borderMask) {
+                pm = borderMask->ptr<Vec3f>(y);
+                for (int x=0; x<width; x++) {
+                    ps[x][0] *= pm[x][0];
+                    ps[x][1] *= pm[x][1];
+                    ps[x][2] *= pm[x][2];
+                }
+            }
+            
+            // apply per-pixel cos phi factor to correct for the light angle
+            if (applyCosFactor) {
+                for (int x=0; x<width; x++) {
+                    // calculate center pixel position
+                    pos = screenCenter +  down * ((y+0.5) * cube.delY - (cube.screenSizeMm.height-cube.delY)/2.0)
+                                       + right * ((x+0.5) * cube.delX - (cube.screenSizeMm.width-cube.delX)/2.0);  
+                    
+                    // pixel cos phi factor : angle between light ray from pixel to origin and the pixels surface normal
+                    double cosPhi = screenNormal.dot (-pos) / ( screenNormalLength * norm(-pos) );
+                    ps[x][0] = ps[x][0] / cosPhi;
+                    ps[x][1] = ps[x][1] / cosPhi;
+                    ps[x][2] = ps[x][2] / cosPhi;
+                }
+            }
+            
+            // maximum required radiance, absolute and relative to the maximum screen radiance (x/0 counts as 0)
+            for (int x=0; x<width; x++) {
+                for (int c=0; c<3; c++) {
+                    maxRequired = max(maxRequired, ps[x][c]);
+                    if (pmax[x][c] != 0) {
+                        maxRatio = max(maxRatio, ps[x][c] / pmax[x][c]);
+                    }
+                }
+            }
+        }
+        
+        bandMaxRequired[b] = maxRequired;
+        bandMaxRatio[b] = maxRatio;
+    }
+}
+
+
+/**
+  Band pass 2: exposure multiplier and range-maximization slicing
+*/
+void HDRBandSlice::operator() (const Range& bands) const
+{
+    const int width = cube.screenSizePixel.width;
+    
+    // scratch rows for the slicing kernel (one set per task)
+    vector<float> residual (3*width);
+    
+    for (int b=bands.start; b<bands.end; b++) {
+        int yEnd = min((b+1)*bandHeight, cube.screenSizePixel.height);
+        
+        for (int y=b*bandHeight; y<yEnd; y++) {
+            float* req = cube.screenRequired.ptr<float>(y);
+            for (int i=0; i<3*width; i++) {
+                req[i] = req[i] * scale;
+            }
+            
+            slice_row (req, cube.maxScreenRadiance.ptr<float>(y), cube.minLight.ptr<float>(y), width, y, cube.svrTable,
+                       sequence.numFrames, sequence.count.ptr<ushort>(y), &residual[0], sequence.residual.ptr<uchar>(y));
+        }
+    }
+}
+
+
 /**
    The HDR algorithm
 */
-double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Matx31d& down, Matx31d& right, Size2i screenSizeNoBorder, Size2i borderSize, int numFrames, double scale=0.0, bool applyCosFactor=false, double hdrSequenceBlurSize=0)
+double CubeMap::calc_hdr_frames (HDRSequence& sequence, Matx31d& screenCenter, Matx31d& down, Matx31d& right, Size2i screenSizeNoBorder, Size2i borderSize, int numFrames, double scale=0.0, bool applyCosFactor=false, double hdrSequenceBlurSize=0)
 {
     
     cout << "performing forward projection ... " << flush;
@@ -346,21 +494,20 @@ double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Mat
         cout << " took " << sw_elapsed_ms() << " ms" << endl;
     
     #else
-        screenRequired = Mat::zeros(screenRequired.size(), CV_32FC3);
         screenRequired = project_forward(screenRequired, envMapRemaining, screenCenter, down, right);
         sw_stop();
         cout << " took " << sw_elapsed_ms() << " ms" << endl;
         //imwrite ("tmp/required_before.exr",screenRequired);
         
-        // apply border ramp alhpa values 
-        //screenRequired = screenRequired.mul(borderRampMask);
-        multiply(screenRequired, borderRampMask, screenRequired);
+        // border ramp alpha values are applied in the band pass below
         
         cout << "performing backward projection ... " << flush;
         sw_start();
         // 2) backward projection from screen onto cube map to get the used radiance
-        envMapUsed = Mat::zeros(envMapUsed.size(), CV_32FC3);
-        envMapUsed = project_backward(envMapUsed, borderRampMask, screenCenter, down, right);
+        //    (only the regions written in the last step have to be cleared)
+        clear_regions(envMapUsed, dirtyRects);
+        dirtyRects.clear();
+        envMapUsed = project_backward(envMapUsed, borderRampMask, screenCenter, down, right, vector<int>(0), &dirtyRects);
         
         sw_stop();
         cout << " took " << sw_elapsed_ms() << " ms" << endl;
@@ -371,56 +518,44 @@ double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Mat
     cout << "calculating required display radiance ... " << flush;
     sw_start();
     
-    // 3.1) apply per-pixel cos phi factor to correct for the light angle
-    if (applyCosFactor) {
-        Vec3f *ps; 
-        Matx31d pos;
-        Matx31d screenNormal = Mat(down).cross(right);  // TODO check direction
-        for (int y=0; y<screenSizePixel.height; y++) {
-            ps=screenRequired.ptr<Vec3f>(y);
-            for (int x=0; x<screenSizePixel.width; x++) {
-                // calculate center pixel position
-                pos = screenCenter +  down * ((y+0.5) * delY - (screenSizeMm.height-delY)/2.0)
-                                   + right * ((x+0.5) * delX - (screenSizeMm.width-delX)/2.0);  
-                
-                // pixel cos phi factor : angle between light ray from pixel to origin and the pixels surface normal
-                double cosPhi = screenNormal.dot (-pos) / ( norm (screenNormal) * norm(-pos) );
-                ps[x][0] = ps[x][0] / cosPhi;
-                ps[x][1] = ps[x][1] / cosPhi;
-                ps[x][2] = ps[x][2] / cosPhi;
-            }
-        }
-    }
+    // the remaining steps run on horizontal bands of the virtual screen in parallel (see HDRBandPrepare, HDRBandSlice);
+    // a few bands per thread keep the load balanced
+    int numBands = min(screenSizePixel.height, 4*max(1, getNumThreads()));
+    int bandHeight = (screenSizePixel.height + numBands - 1) / numBands;
+    numBands = (screenSizePixel.height + bandHeight - 1) / bandHeight;
+    
+    // 3.1) apply border ramp (CPU only) and per-pixel cos phi factor to correct for the light angle,
+    //      and find the maximum required radiance of each band
+    vector<float> bandMaxRequired (numBands, 0.0f);
+    vector<float> bandMaxRatio (numBands, 0.0f);
+    
+    HDRBandPrepare prepare (*this, bandHeight, screenCenter, down, right, applyCosFactor, bandMaxRequired, bandMaxRatio);
+    #ifdef USE_GPU
+        prepare.borderMask = NULL;              // already applied on the GPU
+    #endif
+    parallel_for_(Range(0, numBands), prepare);
     
     
     // 3.2) calculate exposure multiplier, so that the required radiance completely fits inside the hdr sequence 
     //      and is thus displayed with the maxmimum possible dynamic range
     
     // maximum required radiance
-    double vmin[4], vmax[4];
-    min_max(screenRequired, vmin, vmax);
-    double maxRequired = vmax[3];
+    double maxRequired = 0.0;
+    double maxRatio = 0.0;
+    for (int b=0; b<numBands; b++) {
+        maxRequired = max(maxRequired, (double)bandMaxRequired[b]);
+        maxRatio = max(maxRatio, (double)bandMaxRatio[b]);
+    }
     cout << "maxRequired =" << maxRequired << endl;
     
     bool useAutoScale = false;
     // automaticly chose the best scale factor
     if (scale <= 0) {
-        // maximum required radiance
-        double vmin[4], vmax[4];
-        Mat  tmp =  screenRequired/maxScreenRadiance;
-        min_max(tmp, vmin, vmax);
-        scale =  numFrames / vmax[3];
+        scale =  numFrames / maxRatio;
         cout << " scale is " << scale << endl;
-        //cout << "tmp vmin= " << vmin[3] <<  " vmax= " << vmax[3];
-        //min_max(maxScreenRadiance, vmin, vmax);
-        //cout << "maxScreenRadiance vmin= " << vmin[3] <<  " vmax= " << vmax[3];
         useAutoScale = true;
-         
     }    
     
-    screenRequired.convertTo (screenRequired, -1, scale, 0.0);
-    
-    
     sw_stop();
     cout << " took " << sw_elapsed_ms() << " ms" << endl;
     
@@ -433,37 +568,11 @@ double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Mat
     sw_start();
     
    
-    // apply response curve to pixels between min.. max; set everything else to 0 or 1
-    Vec3f *reqPtr;
-    Vec3f *maxPtr;
-    Vec3f *minPtr;
-    
-
-    int idx=0;
-    float val;
-    for (int y=0; y<screenSizePixel.height; y++) {
-        
-        reqPtr = screenRequired.ptr<Vec3f>(y);
-        maxPtr = maxScreenRadiance.ptr<Vec3f>(y);
-        minPtr = minLight.ptr<Vec3f>(y);
-        
-        for (int x=0; x<screenSizePixel.width; x++) {
-            for (int c=0; c<3; c++) {
-                val = reqPtr[x][c];
-                idx=0;
-                while (val > 0 && idx < numFrames) {
-                    if (val >= maxPtr[x][c]) {
-                        frames[idx].ptr<Vec3f>(y)[x][c] = 1.0;
-                        val -= maxPtr[x][c];
-                    } else {                                                     
-                        frames[idx].ptr<Vec3f>(y)[x][c] = apply_response_svr_subpixel( val + minPtr[x][c], svr, x, y, c );
-                        val=0;
-                    }
-                    idx++;
-                }
-            }
-        }
-    }
+    // 3.3) scale and apply response curve to pixels between min.. max; set everything else to 0 or 1
+    //      (vectorized range maximization, see hdrkernel.cpp; only saturation count and dithered 8 bit residual are stored,
+    //       the frames are expanded while the sequence is displayed)
+    HDRBandSlice slice (*this, bandHeight, sequence, scale);
+    parallel_for_(Range(0, numBands), slice);
 
     sw_stop();
     cout << " took " << sw_elapsed_ms() << " ms" << endl;
@@ -475,8 +584,10 @@ double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Mat
         cout << " scaling up .." << endl;
         
         sw_start();
+        sequence.materialize();
+        vector<Mat>& frames = sequence.frames;
         for (uint f=0; f<frames.size(); f++) {
-            Mat tmp (screenSizeNoBorder, CV_32FC3);
+            Mat tmp (screenSizeNoBorder, frames[f].type());
             resize(frames[f](Rect(0,0,screenSizePixel.width, screenSizePixel.height)), tmp, screenSizeNoBorder, 0,0, INTER_CUBIC);
             
             tmp.copyTo(frames[f](Rect(borderSize.width, borderSize.height, screenSizeNoBorder.width+2*borderSize.width, screenSizeNoBorder.height+2*borderSize.width)));
@@ -488,6 +599,8 @@ double CubeMap::calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Mat
     
     // blur mode: blur first;
     if (hdrSequenceBlurSize > 0) {
+        sequence.materialize();
+        vector<Mat>& frames = sequence.frames;
         int envMapBlurSize = (int)(hdrSequenceBlurSize * frames[0].size().height/2.0) * 2 + 1;
         for (uint f=0; f<frames.size(); f++) {
             GaussianBlur(frames[f], frames[f], Size2d(envMapBlurSize,envMapBlurSize),envMapBlurSize);
@@ -576,16 +689,15 @@ Mat& CubeMap::project_forward (Mat& screen, Mat& env, Matx31d& screenCenter, Mat
 }*/
 
 /**
-   Calculates a forward perspective transform : from one cube side onto the screen plane.
-   The code calculates the position of the screen corners and the intersection points on the specified cube-map plane. 
-   The perspective transformation matrix is calculated with OpenCVs getPerspectiveTransform(), and returned.
+   Calculates the position of the screen corners and their intersection points on the specified cube-map plane.
    @param cubeSide Index of the cube map side
    @param screenCenter Screen center in world coordinates
    @param down Screen plane vector (vertical)
    @param right Screen plane vector (horizontal)
-   @return Perspective Transformation matrix 
+   @param cubeMapPoints Intersection points in cube side pixel coordinates
+   @return true if all corners lie in front of the plane
 */
-Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Matx31d& down, Matx31d& right)
+bool CubeMap::get_side_corners (int cubeSide, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<Point2f>& cubeMapPoints)
 {
     
     // get the four screen corners
@@ -593,13 +705,6 @@ Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Mat
     double x[4] = {-1,  1,-1, 1};
     double y[4] = {-1, -1, 1, 1};
     
-    // in screen coordinates
-    vector<Point2f> screenPoints(4);
-    screenPoints[0] = Point2f(0.5f,0.5f);
-    screenPoints[1] = Point2f(screenSizePixel.width-0.5f,0.5f);
-    screenPoints[2] = Point2f(0.5,screenSizePixel.height-0.5f);
-    screenPoints[3] = Point2f(screenSizePixel.width-0.5f,screenSizePixel.height-0.5f);
-    
     // position of the center of the corner pixels in space: 
     Matx31d corners[4];
     for (int i=0; i<4; i++) {
@@ -609,7 +714,8 @@ Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Mat
     }
 
 
-    vector<Point2f> cubeMapPoints(4);
+    cubeMapPoints.resize(4);
+    bool inFront = true;
     
     // get projected screen corners for this cube side (seen as infinite plane)
     for (int i=0; i<4; i++) {
@@ -621,6 +727,10 @@ Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Mat
         double Z = corners[i](2);
         double mZ = -Z;
         
+        // the corner lies in front of the plane if the coordinate along the side normal is positive
+        const double forward[6] = { mX, Y, X, mY, Z, mZ };
+        inFront = inFront && (forward[cubeSide] > 0);
+        
         { 
             //const float cubeSize = 251;
             const float a = -0.5;
@@ -654,6 +764,33 @@ Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Mat
         }
     }
     
+    return inFront;
+}
+
+
+/**
+   Calculates a forward perspective transform : from one cube side onto the screen plane.
+   The perspective transformation matrix is calculated from the projected screen corners (get_side_corners()) 
+   with OpenCVs getPerspectiveTransform(), and returned.
+   @param cubeSide Index of the cube map side
+   @param screenCenter Screen center in world coordinates
+   @param down Screen plane vector (vertical)
+   @param right Screen plane vector (horizontal)
+   @return Perspective Transformation matrix 
+*/
+Mat CubeMap::get_perspective_transform (int cubeSide, Matx31d& screenCenter, Matx31d& down, Matx31d& right)
+{
+    // in screen coordinates
+    vector<Point2f> screenPoints(4);
+    screenPoints[0] = Point2f(0.5f,0.5f);
+    screenPoints[1] = Point2f(screenSizePixel.width-0.5f,0.5f);
+    screenPoints[2] = Point2f(0.5,screenSizePixel.height-0.5f);
+    screenPoints[3] = Point2f(screenSizePixel.width-0.5f,screenSizePixel.height-0.5f);
+    
+    // projected screen corners on the cube side
+    vector<Point2f> cubeMapPoints;
+    get_side_corners (cubeSide, screenCenter, down, right, cubeMapPoints);
+    
     Mat pmat = getPerspectiveTransform (cubeMapPoints, screenPoints);
  /*   
     Matx31d coord (0,0,1.0);
@@ -759,44 +896,295 @@ bool CubeMap::is_side_visible (int side, Matx31d& screenCenter, Matx31d& down, M
 }
 
 /**  
-  Perform the forward projection : project from cubemap onto screen using multiple perspective transformations
+  Perform the forward projection : project from cubemap onto screen.
+  CPU: single pass over the screen (see ForwardProjection), overwrites every screen pixel.
+  GPU: one perspective transformation per visible cube side, accumulated into the screen.
 */
 MAT& CubeMap::project_forward (MAT& screen, MAT& env, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides)
 {
+    #ifdef USE_GPU 
+        // get visible cube sides that have to be projected
+        if (sides.size() == 0) { 
+            sides = get_sides_to_project(screenCenter, down, right);
+        }
+        
+        for (int s : sides) {
+            // do projection
+            Mat pmat = get_perspective_transform (s, screenCenter, down, right);
+            Rect region (s*cubeSize, 0, cubeSize, cubeSize);
+            env(region).copyTo(cubeSideBufferGPU);
+            gpu::warpPerspective(cubeSideBufferGPU, screenBufferGPU, pmat, screenSizePixel, INTER_LINEAR);
+            gpu::add(screenBufferGPU, screen, screen);
+        }
+    #else
+        screen.create(screenSizePixel, CV_32FC3);
+        ForwardProjection projection (*this, screen, env, screenCenter, down, right, sides);
+        
+        // a screen pixel covers (pixel angle * cubeSize/2) texels at a side's center and up to 3x that at its corners;
+        // only then the footprint has to be integrated
+        double pixelAngle = max(delX, delY) / norm(screenCenter);
+        if (pixelAngle * cubeSize * 1.5 > 1.0) {
+            projection.sat = get_side_sats (env, sides.size() ? sides : get_sides_to_project(screenCenter, down, right));
+        }
+        
+        parallel_for_(Range(0, screenSizePixel.height), projection);
+    #endif
+        
+    return screen;
+
+}
+
 
-    // get visible cube sides that have to be projected
-    if (sides.size() == 0) { 
-        sides = get_sides_to_project(screenCenter, down, right);
+/**
+  Components of a direction relative to a cube side: A, B along the side's x/y axes and F along its normal,
+  so that the position on the side is ( A/F, B/F ) in [-1,1]
+*/
+static inline void side_frame (int side, double X, double Y, double Z, double& A, double& B, double& F)
+{
+    switch (side) {
+        case 0:  A =  Y; B = -Z; F = -X; break;    //-X
+        case 1:  A =  X; B = -Z; F =  Y; break;    //+Y
+        case 2:  A = -Y; B = -Z; F =  X; break;    //+X
+        case 3:  A = -X; B = -Z; F = -Y; break;    //-Y
+        case 4:  A =  X; B =  Y; F =  Z; break;    //+Z
+        default: A =  X; B = -Y; F = -Z; break;    //-Z
+    }
+}
+
+
+/**
+  Drops the summed-area tables of env (e.g. after the whole envmap has been reassigned).
+*/
+void CubeMap::env_modified (const Mat& env)
+{
+    for (uint i=0; i<satCache.size(); i++) {
+        if (satCache[i].env == &env) {
+            satCache.erase(satCache.begin() + i);
+            return;
+        }
+    }
+}
+
+
+/**
+  Marks regions of env as changed. Only sides that are touched get a dirty region; the tables of all
+  other sides (and of all other envmaps) stay valid.
+*/
+void CubeMap::env_modified (const Mat& env, const vector<Rect>& regions)
+{
+    for (SATCache& entry : satCache) {
+        if (entry.env != &env) continue;
+        
+        for (Rect r : regions) {
+            for (int s=0; s<6; s++) {
+                if (entry.sides[s].empty()) continue;
+                Rect sideRegion = r & Rect(s*cubeSize, 0, cubeSize, cubeSize);
+                if (sideRegion.area() == 0) continue;
+                entry.dirty[s].push_back(sideRegion - Point(s*cubeSize, 0));
+            }
+        }
+    }
+}
+
+
+/**
+  Update a side's summed-area table after the texels in the given regions have changed.
+  An entry (y,x) sums all texels above and left of it, so only entries below and right of the top left
+  corner (y0,x0) of the changed texels are affected; row y0 and column x0 are still valid and the entries in
+  between are the integral of the changed block plus those borders.
+*/
+static void update_sat (Mat& sat, const Mat& side, const vector<Rect>& regions)
+{
+    int x0 = side.cols, y0 = side.rows;
+    for (Rect r : regions) {
+        x0 = min(x0, r.x);
+        y0 = min(y0, r.y);
     }
     
-    for (int s : sides) {
+    Mat block;
+    integral (side(Rect(x0, y0, side.cols - x0, side.rows - y0)), block, CV_64F);
     
-        // do projection
-        Mat pmat = get_perspective_transform (s, screenCenter, down, right);
-        Rect region (s*cubeSize, 0, cubeSize, cubeSize);
-       // cout << region << endl;
-        #ifdef USE_GPU 
-           env(region).copyTo(cubeSideBufferGPU);
-           gpu::warpPerspective(cubeSideBufferGPU, screenBufferGPU, pmat, screenSizePixel, INTER_LINEAR);
-           gpu::add(screenBufferGPU, screen, screen);
-        #else
-            Mat tmp (screenSizePixel, screen.type());
-            //stringstream ss; ss << "tmp/env" << s << ".exr";
-            //imwrite(ss.str(), env(region));
-            warpPerspective(env(region), tmp, pmat, screenSizePixel, INTER_LINEAR );
-            screen += tmp;    
-        #endif
+    const Vec3d* top = sat.ptr<Vec3d>(y0);
+    for (int y=1; y<block.rows; y++) {
+        const Vec3d* b = block.ptr<Vec3d>(y);
+        Vec3d* t = sat.ptr<Vec3d>(y0 + y);
+        Vec3d left = t[x0] - top[x0];
+        for (int x=1; x<block.cols; x++) {
+            t[x0 + x] = b[x] + top[x0 + x] + left;
+        }
+    }
+}
+
+
+/**
+  Summed-area tables of the given cube sides of env. Tables are cached per envmap member; sides are built
+  on first use and afterwards only the regions marked by env_modified() are updated.
+*/
+Mat* CubeMap::get_side_sats (Mat& env, vector<int> sides)
+{
+    SATCache* entry = NULL;
+    for (uint i=0; i<satCache.size(); i++) {
+        if (satCache[i].env == &env) entry = &satCache[i];
+    }
+    if (entry == NULL) {
+        satCache.push_back(SATCache());
+        entry = &satCache.back();
+        entry->env = &env;
     }
+    
+    for (int s : sides) {
+        Mat side = env(Rect(s*cubeSize, 0, cubeSize, cubeSize));
+        if (entry->sides[s].empty()) {
+            integral (side, entry->sides[s], CV_64F);
+        } else if (entry->dirty[s].size()) {
+            update_sat (entry->sides[s], side, entry->dirty[s]);
+        }
+        entry->dirty[s].clear();
+    }
+    
+    return entry->sides;
+}
+
+
+/**
+  Forward projection of a range of screen rows: ray direction per pixel, cube side via the major axis,
+  bilinear lookup inside that side (clamped to the side's edge texels). If summed-area tables are given and 
+  the pixel covers more than one texel, the texels inside its footprint are averaged instead.
+*/
+ForwardProjection::ForwardProjection (CubeMap& _cube, Mat& _screen, Mat& _env, Matx31d& _screenCenter, Matx31d& _down, Matx31d& _right, vector<int>& sides)
+ :cube(_cube),
+  screen(_screen),
+  env(_env),
+  screenCenter(_screenCenter),
+  down(_down),
+  right(_right),
+  sat(NULL)
+{
+    // no explicit sides: every side may be hit
+    for (int i=0; i<6; i++) useSide[i] = sides.empty();
+    for (int s : sides) useSide[s] = true;
+}
+
+void ForwardProjection::operator() (const Range& rows) const
+{
+    // LUT for selecting the cubemap side via cartesian coordinates
+    //                       X  Y  Z -X -Y -Z
+    const int sideLUT[6] = { 2, 1, 4, 0, 3, 5 };  
+    
+    const int cubeSize = cube.cubeSize;
+    const double maxCoord = cubeSize-1;
+    const Matx31d step = right * cube.delX;  // one pixel to the right
+    const Matx31d stepDown = down * cube.delY;  // one pixel down
+    
+    Vec3f *ps;  // pointer to a row in screen 
+    
+    for (int y=rows.start; y<rows.end; y++) {
         
-    return screen;
+        ps = screen.ptr<Vec3f>(y);
+        
+        // center of the first pixel of this row
+        Matx31d pos = screenCenter +  down * ((y+0.5) * cube.delY - (cube.screenSizeMm.height-cube.delY)/2.0)
+                                   + right * (0.5 * cube.delX - (cube.screenSizeMm.width-cube.delX)/2.0);  
+        
+        for (int x=0; x<cube.screenSizePixel.width; x++, pos += step) {
+            
+            double X = pos(0);
+            double Y = pos(1);
+            double Z = pos(2);
+            
+            int axis = 0;                                           // start with x coord
+            if (abs (Y) > abs(pos(axis))) axis = 1;                 // if abs value of  y coord is larger, choose that one
+            if (abs (Z) > abs(pos(axis))) axis = 2;                 // if abs value of  z coord is larger, choose that one
+            int s = (pos(axis) > 0) ? sideLUT[axis] : sideLUT[axis+3];
+            
+            if (!useSide[s]) {
+                ps[x] = Vec3f(0,0,0);
+                continue;
+            }
+            
+            // position on the cube side, same formulas as in get_perspective_transform()
+            double A, B, F;
+            side_frame (s, X, Y, Z, A, B, F);
+            double u = (A / F + 1.0) / 2.0 * cubeSize - 0.5;
+            double v = (B / F + 1.0) / 2.0 * cubeSize - 0.5;
+            
+            // texel footprint of the pixel: derivatives of the side position along the screen axes
+            if (sat && !sat[s].empty()) {
+                double Ax, Bx, Fx, Ay, By, Fy;
+                side_frame (s, step(0), step(1), step(2), Ax, Bx, Fx);
+                side_frame (s, stepDown(0), stepDown(1), stepDown(2), Ay, By, Fy);
+                double f = cubeSize / (2.0 * F * F);
+                double hu = 0.5 * ( abs((Ax*F - A*Fx) * f) + abs((Ay*F - A*Fy) * f) );
+                double hv = 0.5 * ( abs((Bx*F - B*Fx) * f) + abs((By*F - B*Fy) * f) );
+                
+                if (hu > 0.5 || hv > 0.5) {
+                    // average of all texels inside the footprint (texel i covers [i-0.5, i+0.5) )
+                    int x0 = clamp ((int) floor(u + 0.5 - hu + 0.5), 0, cubeSize-1);
+                    int y0 = clamp ((int) floor(v + 0.5 - hv + 0.5), 0, cubeSize-1);
+                    int x1 = clamp ((int) floor(u + 0.5 + hu + 0.5), x0+1, cubeSize);
+                    int y1 = clamp ((int) floor(v + 0.5 + hv + 0.5), y0+1, cubeSize);
+                    const Vec3d* r0 = sat[s].ptr<Vec3d>(y0);
+                    const Vec3d* r1 = sat[s].ptr<Vec3d>(y1);
+                    Vec3d sum = r1[x1] - r1[x0] - r0[x1] + r0[x0];
+                    double area = (x1-x0) * (y1-y0);
+                    ps[x] = Vec3f (sum[0] / area, sum[1] / area, sum[2] / area);
+                    continue;
+                }
+            }
+            
+            u = clamp (u, 0.0, maxCoord);
+            v = clamp (v, 0.0, maxCoord);
+            
+            // bilinear interpolation of the four neighboring texels
+            int u0 = min((int)u, cubeSize-2);
+            int v0 = min((int)v, cubeSize-2);
+            float fu = u - u0;
+            float fv = v - v0;
+            const Vec3f* t0 = env.ptr<Vec3f>(v0) + s*cubeSize + u0;
+            const Vec3f* t1 = env.ptr<Vec3f>(v0+1) + s*cubeSize + u0;
+            ps[x] = (t0[0] * (1-fu) + t0[1] * fu) * (1-fv)
+                  + (t1[0] * (1-fu) + t1[1] * fu) * fv;
+        }
+    }
+}
 
+/**
+   Bounding rectangle of the screen on a cube side (side coordinates), padded for bilinear interpolation.
+   Falls back to the whole side if the screen is not completely in front of the side's plane.
+*/
+Rect CubeMap::get_side_footprint (int side, Matx31d& screenCenter, Matx31d& down, Matx31d& right)
+{
+    const int padding = 2;
+    Rect sideRect (0, 0, cubeSize, cubeSize);
+    
+    vector<Point2f> cubeMapPoints;
+    if (! get_side_corners (side, screenCenter, down, right, cubeMapPoints)) {
+        return sideRect;
+    }
+    
+    float minX = cubeMapPoints[0].x, maxX = minX;
+    float minY = cubeMapPoints[0].y, maxY = minY;
+    for (int i=1; i<4; i++) {
+        minX = min(minX, cubeMapPoints[i].x); maxX = max(maxX, cubeMapPoints[i].x);
+        minY = min(minY, cubeMapPoints[i].y); maxY = max(maxY, cubeMapPoints[i].y);
+    }
+    
+    // clamp before converting, the projected corners can be far outside the side
+    int x0 = (int) floor (clamp ((double)minX, -1.0, (double)cubeSize)) - padding;
+    int y0 = (int) floor (clamp ((double)minY, -1.0, (double)cubeSize)) - padding;
+    int x1 = (int) ceil  (clamp ((double)maxX, -1.0, (double)cubeSize)) + padding + 1;
+    int y1 = (int) ceil  (clamp ((double)maxY, -1.0, (double)cubeSize)) + padding + 1;
+    
+    return Rect (x0, y0, x1-x0, y1-y0) & sideRect;
 }
 
 
 /**
-  Perform the backward projection project from screen onto a cubemap using multiple perspective transformations
+   Perform the backward projection : project the screen onto the cube map.
+   Only the footprint of the screen on each visible side is warped and written; the rest of env is not touched.
+   The written regions (envmap coordinates) are appended to footprint, if given.
 */
-MAT& CubeMap::project_backward (MAT& env, MAT& screen, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides)
+MAT& CubeMap::project_backward (MAT& env, MAT& screen, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides, vector<Rect>* footprint)
 {
 
     sides = get_sides_to_project(screenCenter, down, right);
@@ -805,23 +1193,43 @@ MAT& CubeMap::project_backward (MAT& env, MAT& screen, Matx31d& screenCenter, Ma
     
         Mat pmat = get_perspective_transform(s,screenCenter, down, right);
         //if (pmat.data == NULL) continue;
-        Rect region (s*cubeSize, 0, cubeSize, cubeSize);
+        
         // warp onto envmap
         #ifdef USE_GPU 
+            Rect region (s*cubeSize, 0, cubeSize, cubeSize);
             gpu::warpPerspective(screen, cubeSideBufferGPU, pmat, Size(cubeSize, cubeSize), INTER_LINEAR);
             gpu::copyMakeBorder(cubeSideBufferGPU, env, 0, 0, s*cubeSize, (5-s)*cubeSize, BORDER_CONSTANT, CV_RGB(0,0,0));
         #else
-            Mat tmp(Size(cubeSize, cubeSize), CV_32FC3);
-            warpPerspective(screen, tmp, pmat, Size(cubeSize, cubeSize), INTER_LINEAR | WARP_INVERSE_MAP);
-            tmp.copyTo(env(region));
+            Rect side = get_side_footprint(s, screenCenter, down, right);
+            if (side.area() == 0) continue;
+            Rect region (s*cubeSize + side.x, side.y, side.width, side.height);
+            
+            // shift the (inverse) mapping to the origin of the footprint and warp directly into the envmap
+            Mat shift = Mat::eye(3, 3, CV_64F);
+            shift.at<double>(0,2) = side.x;
+            shift.at<double>(1,2) = side.y;
+            Mat dst = env(region);
+            warpPerspective(screen, dst, Mat(pmat * shift), region.size(), INTER_LINEAR | WARP_INVERSE_MAP);
         #endif
         
+        if (footprint) footprint->push_back(region);
     }
     return env;
 
 }
 
-    
+
+/**
+   Set the given regions of img to zero
+*/
+void CubeMap::clear_regions (MAT& img, vector<Rect>& regions)
+{
+    for (Rect r : regions) {
+        img(r).setTo(Scalar::all(0));
+    }
+}
+
+
 /**
   Just show the environment map on the screen using forward projections.
  note: envmap dynamic range has to fit into display range!
@@ -835,7 +1243,6 @@ Mat& CubeMap::show_environment (Matx31d& screenCenter, Matx31d& down, Matx31d& r
         screenUsedGPU.download (screenUsed);
         return screenUsed;
     #else    
-        screenUsed = Mat::zeros(screenUsed.size(), CV_32FC3);
         screenUsed = project_forward(screenUsed, envMapOriginal, screenCenter, down, right);
         screenUsed = screenUsed.mul(borderRampMask);
         return screenUsed;
@@ -13,6 +13,8 @@
 #include <string.h>
 
 #include "util.h"
+#include "svrtable.h"
+#include "hdrkernel.h"
 
 
 using namespace std;
@@ -27,7 +29,14 @@ class CubeMap {
     ~CubeMap ();
     
     // produce a series of hdr frames for illumination; uses range-maximization technique
-    double calc_hdr_frames (vector<Mat>& frames, Matx31d& screenCenter, Matx31d& down, Matx31d& right,  Size2i screenSizeNoBorder, Size2i borderSize, int numFrames, double scale, bool applyCosFactor, double hdrSequenceMapBlurSize);
+    // sequence: created with screen size and numFrames; the frames are expanded in the display's 8 bit layout (dithered)
+    double calc_hdr_frames (HDRSequence& sequence, Matx31d& screenCenter, Matx31d& down, Matx31d& right,  Size2i screenSizeNoBorder, Size2i borderSize, int numFrames, double scale, bool applyCosFactor, double hdrSequenceMapBlurSize);
+    
+    // projected screen corners on one cube side (seen as infinite plane); false if a corner lies behind the plane
+    bool get_side_corners (int cubeSide, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<Point2f>& cubeMapPoints);
+    
+    // bounding rectangle of the screen on one cube side (side coordinates)
+    Rect get_side_footprint (int side, Matx31d& screenCenter, Matx31d& down, Matx31d& right);
     
     // perspective projection matrix from one cube side onto screen 
     Mat get_perspective_transform (int cubeSide, Matx31d& screenCenter, Matx31d& down, Matx31d& right);
@@ -38,11 +47,14 @@ class CubeMap {
     // finds and returns the cube sides that have to be projected onto the screen (assumes screen distance to screen size ratio is large enough)
     vector<int> get_sides_to_project(Matx31d& screenCenter, Matx31d& down, Matx31d& right);
 
-    // project cube map onto screen, with supersampling and cosine factor
+    // project cube map onto screen (CPU: overwrites the screen, GPU: adds to the screen)
     MAT& project_forward (MAT& screen, MAT& env, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides = vector<int>(0));
     
-    // project screen onto cube map, with supersampling and cosine factor 
-    MAT& project_backward (MAT& env, MAT& screen, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides = vector<int>(0));
+    // project screen onto cube map; only writes the footprint of the screen (appended to footprint, if given)
+    MAT& project_backward (MAT& env, MAT& screen, Matx31d& screenCenter, Matx31d& down, Matx31d& right, vector<int> sides = vector<int>(0), vector<Rect>* footprint = NULL);
+    
+    // set regions of an image to zero
+    void clear_regions (MAT& img, vector<Rect>& regions);
     
     // shows the environment map on the screen (no HDR routine and envMap subtraction)
     Mat& show_environment (Matx31d& screenCenter, Matx31d& down, Matx31d& right);
@@ -59,6 +71,9 @@ class CubeMap {
     
     // display response curve
     SVRInfo svr; 
+    
+    // precompiled per-pixel response interpolation for the virtual screen
+    SVRTable svrTable;
     Size screenSizePixel;   // pixel
     Size screenSizeMm;      // mm
     
@@ -121,6 +136,28 @@ class CubeMap {
     // actual produced radiance in last step (will be subtracted from remaining light)
     MAT envMapUsed;
     
+    // regions of envMapUsed written in the last step (everything else is zero)
+    vector<Rect> dirtyRects;
+    
+    // prefiltered cube sides for the forward projection: per-side summed-area tables (CV_64FC3), built on demand
+    // and cached per envmap member (envMapOriginal, envMapRemaining, envMapCompleted); whenever an envmap changes
+    // its tables have to be invalidated with env_modified()
+    struct SATCache {
+        const Mat* env;                 // envmap member the tables belong to
+        Mat sides[6];                   // empty if not built (yet)
+        vector<Rect> dirty[6];          // changed regions (side coordinates) not yet updated in the tables
+    };
+    vector<SATCache> satCache;
+    
+    // drops the summed-area tables of env (whole envmap changed)
+    void env_modified (const Mat& env);
+    
+    // marks the given regions (envmap coordinates) of env as changed; tables are updated on next use
+    void env_modified (const Mat& env, const vector<Rect>& regions);
+    
+    // summed-area tables of env for the given sides (other sides may be empty)
+    Mat* get_side_sats (Mat& env, vector<int> sides);
+    
     // completed regions of environment map
     MAT envMapCompleted;
     
@@ -139,5 +176,83 @@ class CubeMap {
 
 };
 
+
+// version of the spherical to cube map conversion; part of the cube map cache key, increase it whenever the
+// conversion result changes so cached cube maps are not reused
+#define CUBE_MAP_CACHE_VERSION 2
+
+// parallel conversion from a spherical (lat/long) environment map to a horizontal cube map
+class CubeMapConversion : public ParallelLoopBody {
+
+  public:
+    CubeMapConversion (Mat& _cube, Mat& _spherical, int _cubeSize, int _ssGridSize);
+    
+    virtual void operator() (const Range& rows) const;
+    
+    Mat& cube;
+    Mat& spherical;
+    int cubeSize;
+    int ssGridSize;                     // supersampling grid size (must be uneven)
+    vector<double> offset;              // supersampling positions along one side axis (x * ssGridSize + s)
+    vector<int> sideX[4];               // spherical map column of each column sample of the side faces (-X, +Y, +X, -Y)
+    
+    int sphericalX (double theta) const;
+    int sphericalY (double phi) const;
+};
+
+
+// single pass forward projection of a range of screen rows (CPU version of project_forward);
+// pixels covering more than one texel average their footprint with the summed-area tables
+class ForwardProjection : public ParallelLoopBody {
+
+  public:
+    ForwardProjection (CubeMap& _cube, Mat& _screen, Mat& _env, Matx31d& _screenCenter, Matx31d& _down, Matx31d& _right, vector<int>& sides);
+    
+    virtual void operator() (const Range& rows) const;
+    
+    CubeMap& cube;
+    Mat& screen;
+    Mat& env;
+    Matx31d screenCenter, down, right;
+    bool useSide[6];                    // sides that may be sampled; other pixels are set to 0
+    Mat* sat;                           // summed-area tables per side; NULL: bilinear sampling only
+};
+
+
+// parallel band passes of calc_hdr_frames; each band is a range of bandHeight rows of the virtual screen
+
+// border ramp, cos factor and per-band maximum of required radiance and of required / max. screen radiance
+class HDRBandPrepare : public ParallelLoopBody {
+
+  public:
+    HDRBandPrepare (CubeMap& _cube, int _bandHeight, Matx31d& _screenCenter, Matx31d& _down, Matx31d& _right, bool _applyCosFactor,
+                    vector<float>& _bandMaxRequired, vector<float>& _bandMaxRatio);
+    
+    virtual void operator() (const Range& bands) const;
+    
+    CubeMap& cube;
+    int bandHeight;
+    Matx31d screenCenter, down, right, screenNormal;
+    bool applyCosFactor;
+    Mat* borderMask;                    // NULL: skip border ramp
+    vector<float>& bandMaxRequired;
+    vector<float>& bandMaxRatio;
+};
+
+// exposure scale and range-maximization slicing into the hdr frames
+class HDRBandSlice : public ParallelLoopBody {
+
+  public:
+    HDRBandSlice (CubeMap& _cube, int _bandHeight, HDRSequence& _sequence, double _scale)
+     : cube(_cube), bandHeight(_bandHeight), sequence(_sequence), scale(_scale) {}
+    
+    virtual void operator() (const Range& bands) const;
+    
+    CubeMap& cube;
+    int bandHeight;
+    HDRSequence& sequence;
+    double scale;
+};
+
 #endif // SPHERICAL_H
  
@@ -0,0 +1,226 @@
+/**
+   lightstage : tracking frame source
+
+   Delivers the tracking frames either from a live camera or from a recording, so the tracking can be
+   benchmarked and compared on real session footage without the rig.
+   Recordings store the raw frames with their capture times and the poses tracked during the session.
+
+   @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "framesource.h"
+#include "util.h"
+
+using namespace std;
+using namespace cv;
+
+
+FrameSource::FrameSource ()
+ :frameCount(0),
+  replay(false),
+  realtime(false),
+  replayStarted(false)
+{
+}
+
+FrameSource::~FrameSource ()
+{
+    release();
+}
+
+
+/**
+  Open a video device
+*/
+bool FrameSource::openCamera (int deviceID)
+{
+    release();
+    capt.open(deviceID);
+    if (! capt.isOpened()) {
+        cout << "Error: could not open video device " << deviceID << endl;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+  Request a camera resolution; the camera may deliver another one
+*/
+void FrameSource::setResolution (Size size)
+{
+    if (replay || size.area() <= 0) return;
+    capt.set(CV_CAP_PROP_FRAME_WIDTH, size.width);
+    capt.set(CV_CAP_PROP_FRAME_HEIGHT, size.height);
+}
+
+
+/**
+  Open a recording for replay
+*/
+bool FrameSource::openReplay (string dir, bool _realtime)
+{
+    release();
+    string filename = dir + "/" + FRAME_RECORD_FILE;
+    replayFile.open (filename.c_str(), ios::in | ios::binary);
+    if (! replayFile.is_open()) {
+        cout << "Error: cannot open recording " << filename << endl;
+        return false;
+    }
+    replay = true;
+    realtime = _realtime;
+    replayStarted = false;
+    return true;
+}
+
+
+/**
+  Record all following frames and poses into dir
+*/
+bool FrameSource::startRecording (string dir)
+{
+    if (replay) {
+        cout << "Error: cannot record a replay" << endl;
+        return false;
+    }
+    string filename = dir + "/" + FRAME_RECORD_FILE;
+    frameFile.open (filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if (! frameFile.is_open()) {
+        cout << "Error: cannot write recording " << filename << endl;
+        return false;
+    }
+    return startPoseLog (dir + "/" + POSE_RECORD_FILE);
+}
+
+
+/**
+  Write all following poses to a text file
+*/
+bool FrameSource::startPoseLog (string filename)
+{
+    poseFile.open (filename.c_str(), ios::out | ios::trunc);
+    if (! poseFile.is_open()) {
+        cout << "Error: cannot write pose log " << filename << endl;
+        return false;
+    }
+    poseFile << "# index err numMarkers latency droppedFrames camPos(3) rotVec(3) level" << endl;
+    return true;
+}
+
+
+/**
+  Append a pose to the pose log (if enabled)
+*/
+void FrameSource::logPose (const FramePose& pose)
+{
+    if (! poseFile.is_open()) return;
+    poseFile.precision(10);
+    poseFile << pose.index << " " << pose.err << " " << pose.numMarkers << " " << pose.latency << " " << pose.droppedFrames << " "
+             << pose.camPos(0) << " " << pose.camPos(1) << " " << pose.camPos(2) << " "
+             << pose.rotVec(0) << " " << pose.rotVec(1) << " " << pose.rotVec(2) << " " << pose.level << "\n";
+}
+
+
+/**
+  Read the next frame from the camera (recording it if enabled) or from the replay
+*/
+bool FrameSource::read (Mat& frame, timespec& captureTime, unsigned long& index)
+{
+    if (! replay) {
+        if (!capt.grab()) {
+            cout << "Error capturing video frame" << endl;
+            return false;
+        }
+        clock(captureTime);
+        capt.retrieve(frame);
+        index = frameCount++;
+
+        if (frameFile.is_open()) {
+            if (! frame.isContinuous()) frame = frame.clone();
+            FrameRecordHeader header;
+            header.index = index;
+            header.sec = captureTime.tv_sec;
+            header.nsec = captureTime.tv_nsec;
+            header.rows = frame.rows;
+            header.cols = frame.cols;
+            header.type = frame.type();
+            header.reserved = 0;
+            frameFile.write ((const char*) &header, sizeof(header));
+            frameFile.write ((const char*) frame.data, frame.total() * frame.elemSize());
+        }
+        return true;
+    }
+
+    // replay
+    FrameRecordHeader header;
+    if (! replayFile.read ((char*) &header, sizeof(header))) return false;   // end of recording
+    frame.create (header.rows, header.cols, header.type);
+    if (! replayFile.read ((char*) frame.data, frame.total() * frame.elemSize())) {
+        cout << "Error: recording is truncated at frame " << header.index << endl;
+        return false;
+    }
+    index = header.index;
+    frameCount++;
+
+    // shift the recorded time to the replay
+    timespec recorded;
+    recorded.tv_sec = header.sec;
+    recorded.tv_nsec = header.nsec;
+    if (! replayStarted) {
+        recordStart = recorded;
+        clock(replayStart);
+        replayStarted = true;
+    }
+    captureTime = add_ms (replayStart, elapsed_ms (recordStart, recorded));
+
+    // wait until the frame is due
+    if (realtime) {
+        timespec tnow;
+        clock(tnow);
+        sleep (elapsed_ms (tnow, captureTime) / 1000.0);
+    }
+    return true;
+}
+
+
+void FrameSource::release ()
+{
+    if (capt.isOpened()) capt.release();
+    if (frameFile.is_open()) frameFile.close();
+    if (poseFile.is_open()) poseFile.close();
+    if (replayFile.is_open()) replayFile.close();
+    replay = false;
+    frameCount = 0;
+}
+
+
+bool FrameSource::isOpened ()
+{
+    return replay ? replayFile.is_open() : capt.isOpened();
+}
+
+
+/**
+  Read a pose log written by FrameSource::logPose()
+*/
+bool read_pose_log (string filename, vector<FramePose>& poses)
+{
+    ifstream in (filename.c_str());
+    if (! in.is_open()) {
+        cout << "Error: cannot open pose log " << filename << endl;
+        return false;
+    }
+    poses.clear();
+    string line;
+    while (getline (in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss (line);
+        FramePose p;
+        ss >> p.index >> p.err >> p.numMarkers >> p.latency >> p.droppedFrames
+           >> p.camPos(0) >> p.camPos(1) >> p.camPos(2) >> p.rotVec(0) >> p.rotVec(1) >> p.rotVec(2);
+        if (! ss) continue;
+        if (! (ss >> p.level)) p.level = 0;    // logs without the level column
+        poses.push_back(p);
+    }
+    return true;
+}
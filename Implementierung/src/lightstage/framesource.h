@@ -0,0 +1,102 @@
+// tracking frame source: live camera (optionally recorded to disk) or replay of a recording
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+#include <opencv2/highgui/highgui.hpp>  // OpenCV window and video I/O
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+using namespace std;
+using namespace cv;
+
+
+// A recording is a directory with
+//   frames.raw   for every frame: FrameRecordHeader, followed by the continuous pixel data
+//   poses.log    one line per tracking pose: see FramePose
+#define FRAME_RECORD_FILE "frames.raw"
+#define POSE_RECORD_FILE "poses.log"
+
+struct FrameRecordHeader {
+    uint64_t index;         // frame number, starting at 0
+    int64_t sec, nsec;      // capture time
+    int32_t rows, cols;
+    int32_t type;           // OpenCV type (CV_8UC3)
+    int32_t reserved;
+};
+
+
+// one tracking pose as written to a pose log
+struct FramePose {
+    unsigned long index;    // frame the pose was calculated from
+    double err;
+    int numMarkers;
+    double latency;         // ms from reading the frame to the published pose
+    unsigned long droppedFrames;
+    int level;              // pyramid level the markers were detected on (0: full resolution)
+    Matx31d camPos;
+    Matx31d rotVec;         // camera rotation as rotation vector (Rodrigues)
+};
+
+// read a pose log; returns false if the file cannot be opened
+bool read_pose_log (string filename, vector<FramePose>& poses);
+
+
+class FrameSource {
+
+  public:
+    FrameSource ();
+    ~FrameSource ();
+
+    // live camera
+    bool openCamera (int deviceID);
+    void setResolution (Size size);  // requested camera resolution
+
+    // replay a recording: with the recorded frame rate (realtime) or as fast as the frames are consumed
+    bool openReplay (string dir, bool realtime);
+
+    // camera: store every frame with its capture time and every pose in dir (must exist)
+    bool startRecording (string dir);
+
+    // write every pose to a log file (also done by startRecording)
+    bool startPoseLog (string filename);
+    void logPose (const FramePose& pose);
+    bool isLoggingPoses () { return poseFile.is_open(); }
+
+    // next frame, its capture time and index; blocks until the frame is due. false on error or end of the replay.
+    // Replayed frames are timed relative to the start of the replay.
+    bool read (Mat& frame, timespec& captureTime, unsigned long& index);
+
+    void release ();
+    bool isOpened ();
+    bool isReplay () { return replay; }
+    bool isLossless () { return replay && !realtime; }  // the consumer must take every frame
+    unsigned long framesRead () { return frameCount; }
+
+  private:
+    VideoCapture capt;
+    unsigned long frameCount;   // frames read so far
+
+    // recording
+    ofstream frameFile;
+    ofstream poseFile;
+
+    // replay
+    bool replay;
+    bool realtime;
+    ifstream replayFile;
+    bool replayStarted;
+    timespec recordStart;   // capture time of the first recorded frame
+    timespec replayStart;   // time the first frame was replayed
+
+    // no copies
+    FrameSource (const FrameSource&);
+    FrameSource& operator= (const FrameSource&);
+};
+
+#endif // FRAMESOURCE_H
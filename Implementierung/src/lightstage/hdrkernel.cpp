@@ -0,0 +1,202 @@
+/**
+   lightstage : vectorized kernels for the HDR frame calculation
+
+   The range-maximization scheme saturates a subpixel in the first floor(val / maxRadiance) frames,
+   shows the residual radiance in the next frame and leaves all later frames black.
+   Instead of walking every subpixel through the frames one by one, we compute the saturation index
+   for a whole row branch-free and keep only the index and the residual (HDRSequence); a frame is
+   expanded from them row by row, as one contiguous stream, right before it is shown.
+   Frames are expanded in the 8 bit layout of the display; the residual is dithered once per row,
+   so the display loop does not have to convert the frames.
+
+   Uses AVX2 or SSE2 if enabled at compile time, plain C++ otherwise.
+
+   @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "hdrkernel.h"
+
+#if defined(__AVX2__)
+ #include <immintrin.h>
+#elif defined(__SSE2__)
+ #include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace cv;
+
+
+/**
+  Number of saturated frames and remaining radiance for n subpixels.
+*/
+void saturation_count (const float* required, const float* maxRadiance, int n, int numFrames, ushort* count, float* rest)
+{
+    int i=0;
+
+    #if defined(__AVX2__)
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 nf = _mm256_set1_ps((float)numFrames);
+        for (; i+8<=n; i+=8) {
+            __m256 v = _mm256_loadu_ps(required+i);
+            __m256 m = _mm256_loadu_ps(maxRadiance+i);
+            // q = (v > 0) ? floor(min(v/m, numFrames)) : 0
+            __m256 q = _mm256_floor_ps(_mm256_min_ps(_mm256_div_ps(v, m), nf));
+            q = _mm256_and_ps(q, _mm256_cmp_ps(v, zero, _CMP_GT_OQ));
+            __m256i qi = _mm256_cvttps_epi32(q);
+            _mm_storeu_si128((__m128i*)(count+i), _mm_packs_epi32(_mm256_castsi256_si128(qi), _mm256_extracti128_si256(qi, 1)));
+            _mm256_storeu_ps(rest+i, _mm256_sub_ps(v, _mm256_mul_ps(q, m)));
+        }
+    #elif defined(__SSE2__)
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 nf = _mm_set1_ps((float)numFrames);
+        for (; i+4<=n; i+=4) {
+            __m128 v = _mm_loadu_ps(required+i);
+            __m128 m = _mm_loadu_ps(maxRadiance+i);
+            // truncation equals floor here, because the quotient is masked to positive values below
+            __m128 q = _mm_min_ps(_mm_div_ps(v, m), nf);
+            q = _mm_cvtepi32_ps(_mm_cvttps_epi32(q));
+            q = _mm_and_ps(q, _mm_cmpgt_ps(v, zero));
+            _mm_storel_epi64((__m128i*)(count+i), _mm_packs_epi32(_mm_cvttps_epi32(q), _mm_setzero_si128()));
+            _mm_storeu_ps(rest+i, _mm_sub_ps(v, _mm_mul_ps(q, m)));
+        }
+    #endif
+
+    // scalar fallback and remainder
+    for (; i<n; i++) {
+        float v = required[i];
+        float q = 0;
+        if (v > 0) {
+            q = v / maxRadiance[i];
+            q = (q < numFrames) ? floor(q) : numFrames;
+        }
+        count[i] = (ushort)q;
+        rest[i] = v - q * maxRadiance[i];
+    }
+}
+
+
+// 4x4 Bayer matrix as dither offsets in (0,1)
+static const float BAYER4[4][4] = {
+    {  0.5f/16,  8.5f/16,  2.5f/16, 10.5f/16 },
+    { 12.5f/16,  4.5f/16, 14.5f/16,  6.5f/16 },
+    {  3.5f/16, 11.5f/16,  1.5f/16,  9.5f/16 },
+    { 15.5f/16,  7.5f/16, 13.5f/16,  5.5f/16 }
+};
+
+/**
+  Ordered dithering of one row of residual drive values to 8 bit.
+  All subpixels of a pixel share the threshold, so the dither does not tint.
+*/
+void dither_row (const float* residual, int width, int y, uchar* residual8)
+{
+    const float* threshold = BAYER4[y & 3];
+    for (int x=0; x<width; x++) {
+        float t = threshold[x & 3];
+        for (int c=0; c<3; c++) {
+            int v = (int)(residual[3*x+c] * 255.0f + t);
+            residual8[3*x+c] = (uchar) (v < 0 ? 0 : (v > 255 ? 255 : v));
+        }
+    }
+}
+
+
+/**
+  Write row k of the sequence from saturation count and residual drive values.
+*/
+void write_frame_row (const ushort* count, const uchar* residual8, int n, int k, uchar* out)
+{
+    int i=0;
+
+    #if defined(__SSE2__)
+        // 16 subpixels per step: two 16 bit compares (counts <= HDR_MAX_FRAMES), packed to byte masks (all ones stays 255)
+        const __m128i kv = _mm_set1_epi16((short)k);
+        for (; i+16<=n; i+=16) {
+            __m128i q0 = _mm_loadu_si128((const __m128i*)(count+i));
+            __m128i q1 = _mm_loadu_si128((const __m128i*)(count+i+8));
+            __m128i lt = _mm_packs_epi16 (_mm_cmpgt_epi16(q0, kv), _mm_cmpgt_epi16(q1, kv));
+            __m128i eq = _mm_packs_epi16 (_mm_cmpeq_epi16(q0, kv), _mm_cmpeq_epi16(q1, kv));
+            __m128i r = _mm_loadu_si128((const __m128i*)(residual8+i));
+            _mm_storeu_si128((__m128i*)(out+i), _mm_or_si128(lt, _mm_and_si128(eq, r)));
+        }
+    #endif
+
+    for (; i<n; i++) {
+        out[i] = (k < count[i]) ? 255 : ((k == count[i]) ? residual8[i] : 0);
+    }
+}
+
+
+/**
+  Range-maximization slicing of one screen row into saturation count and 8 bit residual.
+*/
+void slice_row (const float* required, const float* maxRadiance, const float* minLight, int width, int y,
+                const SVRTable& svrTable, int numFrames, ushort* count, float* residual, uchar* residual8)
+{
+    int n = 3*width;
+
+    // 1) saturation index and remaining radiance for the whole row
+    saturation_count (required, maxRadiance, n, numFrames, count, residual);
+
+    // 2) inverse response for the residual (the only gather in the kernel)
+    for (int x=0; x<width; x++) {
+        for (int c=0; c<3; c++) {
+            int i = 3*x + c;
+            if (count[i] < numFrames && residual[i] > 0) {
+                residual[i] = svrTable.apply (residual[i] + minLight[i], x, y, c);
+            } else {
+                residual[i] = 0;
+            }
+        }
+    }
+
+    // 3) 8 bit drive values; the frames are expanded from count and residual when they are shown
+    dither_row (residual, width, y, residual8);
+}
+
+
+void HDRSequence::create (Size size, int _numFrames)
+{
+    numFrames = _numFrames;
+    assert (numFrames <= HDR_MAX_FRAMES);
+    count.create (size, CV_16UC3);
+    residual.create (size, CV_8UC3);
+    count.setTo (Scalar::all(0));
+    residual.setTo (Scalar::all(0));
+    frames.clear();
+}
+
+
+/**
+  Expand a region of frame k row by row
+*/
+void HDRSequence::expand (int k, Mat dst, Rect region) const
+{
+    if (region.area() == 0) region = Rect (Point(0,0), size());
+    assert (dst.size() == region.size() && dst.type() == CV_8UC3);
+
+    if (isMaterialized()) {
+        frames[k](region).copyTo(dst);
+        return;
+    }
+    int n = 3*region.width;
+    for (int y=0; y<region.height; y++) {
+        write_frame_row (count.ptr<ushort>(region.y + y) + 3*region.x, residual.ptr<uchar>(region.y + y) + 3*region.x,
+                         n, k, dst.ptr<uchar>(y));
+    }
+}
+
+Mat HDRSequence::frame (int k) const
+{
+    Mat f (size(), CV_8UC3);
+    expand (k, f);
+    return f;
+}
+
+
+void HDRSequence::materialize ()
+{
+    if (isMaterialized()) return;
+    vector<Mat> all (numFrames);
+    for (int k=0; k<numFrames; k++) all[k] = frame(k);
+    frames.swap(all);
+}
@@ -0,0 +1,62 @@
+// vectorized kernels for the HDR frame calculation
+
+#ifndef HDRKERNEL_H
+#define HDRKERNEL_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+
+#include <iostream>
+#include <vector>
+
+#include "util.h"
+#include "svrtable.h"
+
+using namespace std;
+using namespace cv;
+
+
+// longest sequence: the saturation count is stored as 16 bit and compared signed
+#define HDR_MAX_FRAMES 32767
+
+// number of completely saturated frames (floor(val / maxRadiance), clamped to numFrames <= HDR_MAX_FRAMES) and the
+// remaining radiance for n subpixels; values <= 0 produce no saturated frame
+void saturation_count (const float* required, const float* maxRadiance, int n, int numFrames, ushort* count, float* rest);
+
+// quantize the residual drive values (0..1) of screen row y (3*width subpixels) to 8 bit with an ordered 4x4 Bayer dither
+void dither_row (const float* residual, int width, int y, uchar* residual8);
+
+// expand saturation count and 8 bit residual of n subpixels into row k of the sequence:
+// 255 for k < count, residual for k == count and 0 otherwise
+void write_frame_row (const ushort* count, const uchar* residual8, int n, int k, uchar* out);
+
+// range-maximization slicing of one screen row (3*width subpixels) into a row of an HDRSequence (count, residual8);
+// residual is a scratch buffer of 3*width floats
+void slice_row (const float* required, const float* maxRadiance, const float* minLight, int width, int y,
+                const SVRTable& svrTable, int numFrames, ushort* count, float* residual, uchar* residual8);
+
+
+// Compact HDR sequence: per subpixel the number of saturated frames and the dithered 8 bit residual drive value.
+// The memory does not depend on the sequence length; frame k is expanded when it is needed.
+class HDRSequence {
+
+  public:
+    HDRSequence () : numFrames(0) {}
+
+    void create (Size size, int numFrames);     // black sequence
+    Size size () const { return count.size(); }
+
+    // region of frame k into dst (CV_8UC3 of the region size); whole frame if region is empty
+    void expand (int k, Mat dst, Rect region=Rect()) const;
+    Mat frame (int k) const;
+
+    // store all frames, for post-processing them as images (blur); expand() then copies from the frames
+    void materialize ();
+    bool isMaterialized () const { return not frames.empty(); }
+
+    Mat count;                  // CV_16UC3: saturated frames per subpixel
+    Mat residual;               // CV_8UC3: drive value of frame count
+    int numFrames;
+    vector<Mat> frames;         // CV_8UC3, only if materialized
+};
+
+#endif // HDRKERNEL_H
@@ -20,7 +20,7 @@ void help()
             "Image data is aquired by controlling a DSLR in time with the illumination. " << endl <<
         "Usage: \n" <<
         " " << PROGNAME << " <cam_device> <cam_params.yml> <disp_params.yml> <lightstage_params.yml> <output/path>" << endl <<
-        "      <cam_device>              An integer to denote a /dev/video# device or a path to a video file." << endl <<
+        "      <cam_device>              An integer to denote a /dev/video# device or a tracking recording directory." << endl <<
         "      <cam_params.yml>          Camera Matrix and Distortion coefficients (from calibrate_camera)" << endl <<
         "      <disp_params.yml>         Display parameters (from evaluate_display --svr)" << endl <<
         "      <lightstage_params.yml>   Light stage configuration file (most important parameters are here)" << endl <<
@@ -67,9 +67,6 @@ void* capture_thread (void *ptr)
 */
 int run (int argc, char* argv[]) 
 {
-    // misc init code
-    setNumThreads(4);
-    
     // time init
     sw_start();
 
@@ -116,26 +113,23 @@ int run (int argc, char* argv[])
        cout << "disabled" << endl;
     #endif
     
-    // open video device or file with OpenCV
-    VideoCapture capt;
+    // open video device or replay a tracking recording (with the recorded frame rate)
+    FrameSource source;
     
-    bool haveLiveStream = false;
+    struct stat camDeviceStat;
+    bool haveLiveStream = not (stat(argv[1], &camDeviceStat) == 0 && S_ISDIR(camDeviceStat.st_mode));
 
-    capt.open(camDeviceID);
-    haveLiveStream = true;
+    if (haveLiveStream) {
+        source.openCamera(camDeviceID);
+    } else {
+        source.openReplay(argv[1], true);
+    }
     
-    if ( ! capt.isOpened() ) {
-        cout << " could not open video device " << camDeviceID <<endl;
+    if ( ! source.isOpened() ) {
         return -1;
     }
     
-    // input framebuffer
-    Mat frame;
-    capt >> frame;
-    
-    cout << "successfully openend video " << (haveLiveStream?"device":"file") << " " << camDeviceID << endl;
-    
-    cout << "video frame size is " << frame.size() << endl; 
+    cout << "successfully openend " << (haveLiveStream?"video device ":"tracking recording ") << argv[1] << endl;
 
     
     //
@@ -166,46 +160,10 @@ int run (int argc, char* argv[])
     
     // load SVR data
     SVRInfo svr; 
-    
-    // assert that response type is SVR
-    string type;
-    fs["type"] >> type;
-    assert (strcasecmp(type.c_str(), "svr") == 0);
-                     
-    fs["borderSize"] >> svr.borderSize;         // width/height of vertical/horizontal border
-    fs["screenSize"] >> svr.screenSize;         // screen size in pixels
-    fs["colorTransform"] >> svr.colorTransMat;  // color transformation matrix
-    fs["patchLayout"] >> svr.patchLayout;       // number of patches in x / y direction
-    fs["patchSize"] >> svr.patchSize;           // size of one square patch
-    
-    // check if patch layout and definitions are consistent
-    if (not svr.checkValues()) {
+    if (not load_svr (fs, svr)) {
         fs.release();
         return -1;
     }
-
-    // load response curves
-    svr.size = svr.patchLayout.width * svr.patchLayout.height;
-    svr.vMin.resize(svr.size);
-    svr.vMax.resize(svr.size);
-    svr.response.resize(svr.size);
-    
-    for (int n=0; n<svr.size; n++) {
-        stringstream ss;
-        ss << "min_" << n;
-        fs[ss.str().c_str()] >> svr.vMin[n];
-        
-        ss.str(string());
-        ss << "max_" << n;
-        fs[ss.str().c_str()] >> svr.vMax[n];
-        
-        ss.str(string());
-        ss << "response_" << n;
-        fs[ss.str().c_str()] >> svr.response[n];
-        
-        // stdout progress dots
-        if (n % (svr.size/10) == 0) cout << "." << flush;
-    }
     
     fs.release();
     cout << " done!" << endl;
@@ -234,6 +192,7 @@ int run (int argc, char* argv[])
     double stageAngleTolerance;        fs["stageAngleTolerance"] >> stageAngleTolerance;
     double allowedDrift=10;            fs["allowedDrift"] >> allowedDrift;
     double stabilityTolerance=10;      fs["stabilityTolerance"] >> stabilityTolerance;
+    int stabilityWindow=10;            fs["stabilityWindow"] >> stabilityWindow;
     Vec3d stageOrigin(0,0,0);          fs["stageOrigin"] >> stageOrigin;
     bool fixedCamera=false;            fs["fixedCamera"] >> fixedCamera;
     Mat cameraRotation;                fs["cameraRotation"] >> cameraRotation;
@@ -255,6 +214,15 @@ int run (int argc, char* argv[])
     int trackingThreshold;             fs["trackingThreshold"] >> trackingThreshold;
     bool trackingUseInverted;          fs["trackingUseInverted"] >> trackingUseInverted;
     bool trackingUseColor;             fs["trackingUseColor"] >> trackingUseColor;
+    bool trackingUndistortPoints=false; fs["trackingUndistortPoints"] >> trackingUndistortPoints;
+    bool trackingPrediction=false;     fs["trackingPrediction"] >> trackingPrediction;
+    bool trackingROI=false;            fs["trackingROI"] >> trackingROI;
+    int trackingROIFullSearch=30;      fs["trackingROIFullSearch"] >> trackingROIFullSearch;
+    bool trackingAutoThreshold=false;  fs["trackingAutoThreshold"] >> trackingAutoThreshold;
+    int trackingAutoThresholdInterval=15; fs["trackingAutoThresholdInterval"] >> trackingAutoThresholdInterval;
+    Size2i trackingResolution;         fs["trackingResolution"] >> trackingResolution;
+    int trackingPyramidLevel=0;        fs["trackingPyramidLevel"] >> trackingPyramidLevel;
+    bool trackingRecord=false;         fs["trackingRecord"] >> trackingRecord;
     
     string envMapFile;                 fs["envMapFile"] >> envMapFile;
     double envMapExposure;             fs["envMapExposure"] >> envMapExposure;
@@ -263,6 +231,7 @@ int run (int argc, char* argv[])
     double radianceMultiplier;         fs["radianceMultiplier"] >> radianceMultiplier;
     bool useCosFactor=false;           fs["useCosFactor"] >> useCosFactor;
     bool useColorSpaceTransform;       fs["useColorSpaceTransform"] >> useColorSpaceTransform;
+    string envMapCacheDir;             fs["envMapCacheDir"] >> envMapCacheDir;
     bool useAntiShake=false;           fs["useAntiShake"] >> useAntiShake; 
      
     bool dumpTrackingImage=false;      fs["dumpTrackingImage"] >> dumpTrackingImage; 
@@ -281,10 +250,22 @@ int run (int argc, char* argv[])
     fs["soundNotificationCommand"] >> soundNotificationCommand;
     fs["backlightControlCommand"] >> backlightControlCommand;
     
+    // worker threads for OpenCV and the parallel HDR frame calculation; 0 -> one per cpu core
+    int numThreads=4;                  fs["numThreads"] >> numThreads;
+    if (numThreads <= 0) numThreads = getNumberOfCPUs();
+    
     
     fs.release();
     cout << " done!" << endl;
     
+    setNumThreads(numThreads);
+    cout << "using " << numThreads << " threads" << endl;
+    
+    if (hdrSequenceSize < 1 || hdrSequenceSize > HDR_MAX_FRAMES) {
+        cout << "Error: hdrSequenceSize must be between 1 and " << HDR_MAX_FRAMES << endl;
+        return -1;
+    }
+    
     //
     // setup remote DSLR camera connection
     //
@@ -345,51 +326,94 @@ int run (int argc, char* argv[])
     // load and preprocess environment map
     //
     
-    Mat envMap = imread (envMapFile, CV_LOAD_IMAGE_UNCHANGED);
-    if (envMap.data == NULL ) {
-        cout << "Error: cannot load " << envMapFile << endl;
-        return -1;
+    // converted cube maps are cached; the cache file name is a hash of everything that influences the result
+    string envMapCacheFile;
+    Mat envMap;
+    if (not envMapCacheDir.empty()) {
+        stringstream key;
+        key << "v" << CUBE_MAP_CACHE_VERSION << " " << envMapFile << " " << file_mtime(envMapFile) << " " << envMapExposure << " " << envMapBlurSize << " " 
+            << envMapResize << " " << useColorSpaceTransform;
+        if (useColorSpaceTransform) key << " " << svr.colorTransMat;
+        
+        string name = envMapFile.substr(envMapFile.find_last_of('/') + 1);
+        name = name.substr(0, name.find_last_of('.'));
+        stringstream ss; ss << envMapCacheDir << "/" << name << "_" << hex << hash_string(key.str()) << ".exr";
+        envMapCacheFile = ss.str();
+        
+        envMap = imread (envMapCacheFile, CV_LOAD_IMAGE_UNCHANGED);
+        if (envMap.data != NULL) {
+            cout << "loaded cached cube map " << envMapCacheFile << endl;
+        }
     }
     
-    if (not ( (envMap.type() == CV_32FC3) || (envMap.type() == CV_64FC3)) ) {
-        cout << "Warning: environment map " << envMapFile << " is not in 32 bit HDR format!" << endl;
-        envMap.convertTo(envMap, CV_32FC3, 1.0/255.0, 0);
-    }
+    bool envMapFromCache = (envMap.data != NULL);
+    if (not envMapFromCache) {
     
-    if (useColorSpaceTransform && svr.colorTransMat.data != NULL) {
-        cout << "applying color transform to environment map ..." << flush;
-        for (uint i=0; i<envMap.total(); i++) {
-            Mat val(envMap.at<Vec3f>(i));
-            val = Mat_<float>(svr.colorTransMat) * val;
-            envMap.at<Vec3f>(i) = Vec3f(val);
+        envMap = imread (envMapFile, CV_LOAD_IMAGE_UNCHANGED);
+        if (envMap.data == NULL ) {
+            cout << "Error: cannot load " << envMapFile << endl;
+            return -1;
         }
-        cout << " done!" << endl;
-    }
     
+        if (not ( (envMap.type() == CV_32FC3) || (envMap.type() == CV_64FC3)) ) {
+            cout << "Warning: environment map " << envMapFile << " is not in 32 bit HDR format!" << endl;
+            envMap.convertTo(envMap, CV_32FC3, 1.0/255.0, 0);
+        }
     
-    // experiment: simulate different aperture (manual calculation if kernel sized required)
-    // simple envmap blur   
-    // TODO: the math, requires DLSR extrinsics
-    if (envMapBlurSize > 0) {
-        envMapBlurSize = (int)(envMapBlurSize * envMap.size().height/2.0) * 2 + 1;
-        cout << "filtering input envmap with a gaussian of size " << envMapBlurSize << " ..." << flush;
-        GaussianBlur(envMap, envMap, Size2d(envMapBlurSize,envMapBlurSize),envMapBlurSize);
-        cout << " done" << endl;
-    }
+        if (useColorSpaceTransform && svr.colorTransMat.data != NULL) {
+            cout << "applying color transform to environment map ..." << flush;
+            for (uint i=0; i<envMap.total(); i++) {
+                Mat val(envMap.at<Vec3f>(i));
+                val = Mat_<float>(svr.colorTransMat) * val;
+                envMap.at<Vec3f>(i) = Vec3f(val);
+            }
+            cout << " done!" << endl;
+        }
+    
+    
+        // experiment: simulate different aperture (manual calculation if kernel sized required)
+        // simple envmap blur   
+        // TODO: the math, requires DLSR extrinsics
+        if (envMapBlurSize > 0) {
+            envMapBlurSize = (int)(envMapBlurSize * envMap.size().height/2.0) * 2 + 1;
+            cout << "filtering input envmap with a gaussian of size " << envMapBlurSize << " ..." << flush;
+            GaussianBlur(envMap, envMap, Size2d(envMapBlurSize,envMapBlurSize),envMapBlurSize);
+            cout << " done" << endl;
+        }
     
-    // experiment: resize envmap
-    if (envMapResize != 1.0) {
-        cout << "resizing input envmap with scale of " << envMapResize << " ..." <<flush;
-        Mat tmp;
-        resize(envMap, tmp, Size2d(), envMapResize, envMapResize, (envMapResize>0)?INTER_LANCZOS4:INTER_CUBIC);
-        tmp.copyTo(envMap);
-        cout << " done" << endl;
+        // experiment: resize envmap
+        if (envMapResize != 1.0) {
+            cout << "resizing input envmap with scale of " << envMapResize << " ..." <<flush;
+            Mat tmp;
+            resize(envMap, tmp, Size2d(), envMapResize, envMapResize, (envMapResize>0)?INTER_LANCZOS4:INTER_CUBIC);
+            tmp.copyTo(envMap);
+            cout << " done" << endl;
+        }
     }
     
     //
     // init environment map object
     //
     CubeMap environment (envMap, svr, virtScreenSize, screenSizeMm, borderRampSize);
+    
+    // store converted cube map in cache (only spherical maps are converted)
+    bool envMapConverted = (envMap.size().width <= 5*envMap.size().height);
+    if (not envMapCacheFile.empty() && not envMapFromCache && envMapConverted) {
+        if (not make_dirs (envMapCacheDir)) {
+            cout << "Warning: could not create cube map cache directory " << envMapCacheDir << endl;
+        }
+        Mat cube;
+        #ifdef USE_GPU
+            environment.envMapOriginal.download(cube);
+        #else
+            cube = environment.envMapOriginal;
+        #endif
+        if (imwrite (envMapCacheFile, cube)) {
+            cout << "stored cube map in cache " << envMapCacheFile << endl;
+        } else {
+            cout << "Warning: could not write cube map cache " << envMapCacheFile << endl;
+        }
+    }
 
     // show mode: scale envmap so its displayable
 
@@ -433,6 +457,8 @@ int run (int argc, char* argv[])
                 environment.envMapCompleted = min(environment.envMapCompleted, 1.0);
                 environment.envMapCompleted = max(environment.envMapCompleted, 0.0);
                 environment.envMapRemaining -= environment.envMapOriginal.mul(environment.envMapCompleted);
+                environment.env_modified(environment.envMapRemaining);
+                environment.env_modified(environment.envMapCompleted);
             #endif
         }
     }
@@ -440,8 +466,22 @@ int run (int argc, char* argv[])
     // init ARToolKit Tracking
     //
     cout << "initializing ARToolKit tracking ..." << flush;
-    Tracking tracking (capt, camParamsFile, markerConfigFile, trackingThreshold, !trackingUseColor, trackingUseInverted);
+    if (trackingRecord && haveLiveStream) {
+        // camera frames and tracking poses for tracking_bench
+        string recordDir = outDir + "/tracking_recording";
+        mkdir (recordDir.c_str(), 0755);
+        source.startRecording(recordDir);
+    }
+    Tracking tracking (source, camParamsFile, markerConfigFile, trackingThreshold, !trackingUseColor, trackingUseInverted, trackingUndistortPoints, trackingResolution);
+    if (not tracking.isOpened()) {
+        cout << "Error: cannot initialize the tracking" << endl;
+        return -1;
+    }
     tracking.setDebug(dumpTrackingImage);
+    tracking.setROISearch(trackingROI, trackingROIFullSearch);
+    tracking.setAutoThreshold(trackingAutoThreshold, trackingAutoThresholdInterval);
+    tracking.setPyramidLevel(trackingPyramidLevel);
+    tracking.setStabilityWindow(stabilityWindow);
     tracking.start();
     cout << " done!" << endl;
     
@@ -508,13 +548,18 @@ int run (int argc, char* argv[])
     // virtual screen buffer and output screen buffer
     Mat screen = Mat::zeros(virtScreenSize, CV_32FC3);
     Mat screenBuff = Mat::zeros(screenSize, CV_32FC3);
+    // double buffer for the HDR sequence (8 bit like the frames), with black padding for the largest anti-shake shift:
+    // the shift is applied when a frame is shown, as the viewport into the buffer (see shake_viewport)
+    Size2i hdrPadding (allowedShift.x, allowedShift.y);
+    Size paddedScreenSize (screenSize.width + 2*hdrPadding.width, screenSize.height + 2*hdrPadding.height);
+    Mat hdrBuff[2] = { Mat::zeros(paddedScreenSize, CV_8UC3), Mat::zeros(paddedScreenSize, CV_8UC3) };
+    Rect hdrFrameRegion (hdrPadding.width, hdrPadding.height, screenSize.width, screenSize.height);   // unshifted frame
     Mat blackFrame = Mat::zeros(screenSize, CV_32FC3);
-    Mat debugFrame;
-    vector<Mat> hdrFrames;
+    TrackingPose debugPose;     // last pose with tracking debug data; the image is rendered when dumped
+    HDRSequence hdrSequence;    // compact HDR sequence, frames are expanded while displayed
     
     // for timing whole loop
     timespec tlast, tnow;   
-    timespec tlast_hdr, tnow_hdr;   
     
     //displayThreadRunning = false;
     captureThreadRunning = false;
@@ -523,6 +568,7 @@ int run (int argc, char* argv[])
     Matx34d transMat;       
     Matx33d rotMat;
     Matx31d camPos;
+    PoseStats poseStats;    // statistics of the last tracking positions
     
     // true if we currently have a valid position
     bool havePosition = false; 
@@ -593,21 +639,23 @@ int run (int argc, char* argv[])
         } else {
             
             // get tracking position
-            if (tracking.hasNewData()) {
-                tracking.lockThread();
-                rotMat = tracking.getRotation();
-                camPos = tracking.getPosition() - stageOrigin;
-                trackingError = tracking.getError();
-                trackingNumMarker = tracking.getNumMarker();
-                if (dumpTrackingImage || debug ) debugFrame = tracking.getDebugImage();
-                tracking.unlockThread();
+            TrackingPose pose;
+            if (tracking.getPose(pose)) {
+                rotMat = pose.rotMat;
+                camPos = pose.camPos - stageOrigin;
+                trackingError = pose.err;
+                trackingNumMarker = pose.numMarkers;
+                poseStats = pose.stats;
+                if (dumpTrackingImage || debug ) debugPose = pose;
                 
                 // only proceed if enough marker are visible
-                if (tracking.getNumMarker() < numMarkerRequired) {
-                    cout << expcounter << " not enough marker visible (" << tracking.getNumMarker() << ")" << endl;
+                if (pose.numMarkers < numMarkerRequired) {
+                    cout << expcounter << " not enough marker visible (" << pose.numMarkers << ")" << endl;
                 } else {
                     havePosition = true;
-                    cout << expcounter << " new tracking pos thresh= "<< trackingThreshold <<" #marker= " << tracking.getNumMarker() << " err= " << tracking.getError() << " " << endl;
+                    clock(tnow);
+                    cout << expcounter << " new tracking pos thresh= "<< trackingThreshold <<" #marker= " << pose.numMarkers << " err= " << pose.err 
+                         << " age= " << elapsed_ms(pose.captureTime, tnow) << " ms dropped= " << pose.droppedFrames << " " << endl;
                 }
                 
             
@@ -641,11 +689,12 @@ int run (int argc, char* argv[])
                 // 0) require stable position
                 //
                  
-                // the 10 last positions  have to be within a 10 mm radius
-                bool isStable = tracking.hasStablePosition(10, stabilityTolerance);
+                // the last positions (stabilityWindow) have to be within stabilityTolerance of each other
+                bool isStable = tracking.hasStablePosition(stabilityTolerance);
                 if (not isStable) {
                     positionOK = false;
-                    cout << "position is unstable!" << endl;
+                    cout << "position is unstable! (diameter= " << poseStats.diameter << " mm jitter= " << poseStats.deviation 
+                         << " mm speed= " << poseStats.speed << " mm/s " << poseStats.angularSpeed << " deg/s)" << endl;
                  //   play_sound(WARNING);
                  //   sleep(0.5);
                 }
@@ -827,7 +876,7 @@ int run (int argc, char* argv[])
                 
                     sw_start();
                     screen = environment.show_environment (screenCenter, down, right);
-                    apply_response_svr(screen, svr);
+                    environment.svrTable.apply(screen);
                     sw_stop();
                     cout <<  expcounter << " sampling took " <<  sw_elapsed_ms () << " ms" << endl; 
                     
@@ -870,22 +919,22 @@ int run (int argc, char* argv[])
                     cout << expcounter << " calculating " << hdrSequenceSize << " HDR frames " << endl;
                     play_sound(PROC_START);
                     
+                    // precise positions during the sequence display
+                    tracking.setFullResolution(true);
+                    
                     clock(tlast);
                     
                     sw_start();
                                  
-                    // allocate HDR frame storage
-                    hdrFrames.clear();
-                    for (int f=0; f<hdrSequenceSize; f++) {
-                        hdrFrames.push_back(Mat::zeros(screenSize, CV_32FC3));
-                    }
+                    // allocate HDR sequence storage (independent of the sequence length)
+                    hdrSequence.create(screenSize, hdrSequenceSize);
                     sw_stop();
-                    cout <<  expcounter << " frame zeroing took " <<  sw_elapsed_ms () << " ms" << endl; 
+                    cout <<  expcounter << " sequence zeroing took " <<  sw_elapsed_ms () << " ms" << endl; 
               
                     
                     // required factor for relating env map to one frame of display light
                     
-                    double expFactor = environment.calc_hdr_frames(hdrFrames, screenCenter, down, right, screenSizeNoBorder, borderSize, hdrSequenceSize, radianceMultiplier, useCosFactor, hdrSequenceBlurSize);                
+                    double expFactor = environment.calc_hdr_frames(hdrSequence, screenCenter, down, right, screenSizeNoBorder, borderSize, hdrSequenceSize, radianceMultiplier, useCosFactor, hdrSequenceBlurSize);                
 
                     clock(tnow);
                     cout <<  expcounter << " frame calculation took " <<  elapsed_ms (tlast, tnow) << " ms" << endl; 
@@ -927,6 +976,7 @@ int run (int argc, char* argv[])
                     // for anti-shake: image shift in pixels
                     Point2i shakeShift(borderSize);
                     
+                    TrackingPose newPose;
                     Matx33d newRotMat;
                     Matx31d newCamPos;
                     double newTrackingError;
@@ -936,19 +986,23 @@ int run (int argc, char* argv[])
                     
                     
                     // first frame is pasted onto screen buffer here; all others are processed while displaying the previous frame
-                    blackFrame.copyTo(screenBuff);
-                    if (tracking.hasNewData()) {
+                    bool newData = tracking.getPose(newPose);
+                    if (trackingPrediction && newPose.seq > 0) {
+                        // pose extrapolated to the moment the first frame is shown
+                        clock(tnow);
+                        newPose = tracking.predictPose(tnow);
+                        newData = true;
+                    }
+                    if (newData) {
                     
                         //
                         // CODE COPIED FROM INNER LOOP
                         //
                         // get current screen position
-                        tracking.lockThread();
-                        newRotMat = tracking.getRotation();
-                        newCamPos = tracking.getPosition() - stageOrigin;;
-                        newTrackingError = tracking.getError();
-                        newTrackingNumMarker = tracking.getNumMarker();
-                        tracking.unlockThread();
+                        newRotMat = newPose.rotMat;
+                        newCamPos = newPose.camPos - stageOrigin;
+                        newTrackingError = newPose.err;
+                        newTrackingNumMarker = newPose.numMarkers;
                         
                         newScreenCenter = newCamPos + newRotMat * Matx31d(screenPosition); 
                         newDown = (newRotMat.col(1));     // Y = down
@@ -984,44 +1038,57 @@ int run (int argc, char* argv[])
                             
                        
                     }
-                    cout << hdrFrames[0].size() << endl;
-                    
-                    // NOTE: copied from loop
+                    cout << hdrSequence.size() << endl;
                     
-                    Rect availableRegion (0,0,screenBuff.size().width, screenBuff.size().height);
-                    Rect targetRegion = availableRegion+shakeShift;
-                    Rect intersection = targetRegion & availableRegion;
-                    // copy to framebuffer 
-                    hdrFrames[0](intersection - shakeShift ).copyTo( screenBuff( intersection ) );
+                    // expand into the center of the padded framebuffer
+                    hdrSequence.expand(0, hdrBuff[0](hdrFrameRegion));
                         
                     
                     play_sound(PROC_START);
-                    double tookAvg = 0;
-                    cout << expcounter << " displaying " << hdrFrames.size() << " HDR frames ... " << endl;
+                    cout << expcounter << " displaying " << hdrSequence.numFrames << " HDR frames ... " << endl;
                     
-                        clock(tlast_hdr);
+                    // frame deadlines; abort as soon as the sequence can no longer end in time:
+                    // 5% lag tolerance, and within the exposure if the sequence fits into it
+                    double sequenceDuration = hdrSequenceSize / hdrSequenceFPS * 1000;
+                    double exposureWindow = (dslrExposure - captureWaitTime) * 1000;
+                    double maxDuration = 1.05 * sequenceDuration;
+                    if (exposureWindow >= sequenceDuration) maxDuration = min(maxDuration, exposureWindow);
+                    Presenter presenter (hdrSequenceFPS, hdrSequence.numFrames, maxDuration);
                     
-                    for (uint f=0; f<hdrFrames.size(); f++) {
+                    // double buffering: frame 0 is in hdrBuff[0], the compose thread prepares frame f+1
+                    // in the other buffer while frame f is on screen
+                    FrameQueue frameQueue (hdrBuff[0], hdrBuff[1]);
+                    frameQueue.push(0, shakeShift);
+                    atomic<bool> composeFailed (false);
+                    stringstream composeMessages;   // console output of the compose thread, printed after the sequence
                     
-                        sw_start();
-                        
-                        // 1) display frame on screen
-                        imshow("main", screenBuff);
-                        waitKey(1);
+                    presenter.start();
+                    thread composer ([&] () {
+                        for (int f=1; f<hdrSequence.numFrames; f++) {
                         
-                        // for all frames except the last one: calculate next frame
-                        if (f != hdrFrames.size()-1) {
-                        
-                            // 2) get new tracking position, process next frame 
-                            if (tracking.hasNewData()) { 
+                            // 1) expand the frame into the free screen buffer, as soon as the one before the previous frame is off screen;
+                            //    the black padding is never written
+                            Mat backBuff = frameQueue.back(f);
+                            if (backBuff.empty()) return;   // presenter aborted
+                            hdrSequence.expand(f, backBuff(hdrFrameRegion));
+                            
+                            
+                            // 2) get new tracking position and anti-shake offset for the frame, as late as possible
+                            timespec tcompose;
+                            clock(tcompose);
+                            bool newData = tracking.getPose(newPose);
+                            if (trackingPrediction && newPose.seq > 0) {
+                                // pose extrapolated to the moment the frame is shown
+                                newPose = tracking.predictPose(add_ms(tcompose, max(0.0, presenter.timeUntil(f))));
+                                newData = true;
+                            }
+                            if (newData) { 
                             
                                 // get current screen position
-                                tracking.lockThread();
-                                newRotMat = tracking.getRotation();
-                                newCamPos = tracking.getPosition() - stageOrigin;;
-                                newTrackingError = tracking.getError();
-                                newTrackingNumMarker = tracking.getNumMarker();
-                                tracking.unlockThread();
+                                newRotMat = newPose.rotMat;
+                                newCamPos = newPose.camPos - stageOrigin;
+                                newTrackingError = newPose.err;
+                                newTrackingNumMarker = newPose.numMarkers;
                                 
                                 newScreenCenter = newCamPos + newRotMat * Matx31d(screenPosition); 
                                 newDown = (newRotMat.col(1));     // Y = down
@@ -1032,8 +1099,9 @@ int run (int argc, char* argv[])
                                 if (dumpTrackingLog) {
                                     
                                     double newScreenAngle = environment.get_max_angle(newScreenCenter, newDown, newRight);
-                                    logTracking << expcounter << " Frame " << f << " shift ( " << shakeShift.x << " " << shakeShift.y << " ) " 
+                                    logTracking << expcounter << " Frame " << f-1 << " shift ( " << shakeShift.x << " " << shakeShift.y << " ) " 
                                         << "err = " << newTrackingError << " m = " << newTrackingNumMarker << " "
+                                        << "age = " << elapsed_ms(newPose.captureTime, tcompose) << " dropped = " << newPose.droppedFrames << " "
                                         << "pos_pher ( " << cart2spher(newCamPos)(0) << " " << cart2spher(newCamPos)(1) << " " << cart2spher(newCamPos)(2) << " ) "
                                         << "pos_cart ( " << newCamPos(0) << " " << newCamPos(1) << " " << newCamPos(2) << " ) " 
                                         << "fw ( " << newScreenCenter(0) << " " << newScreenCenter(1) << " " << newScreenCenter(2) << " ) "
@@ -1049,49 +1117,62 @@ int run (int argc, char* argv[])
                               
                                     // too large: position error;
                                     if (abs(shakeShift.x) > allowedShift.x || abs(shakeShift.y) > allowedShift.y ) {
-                                        cout << " Error: shift too large for antiShake ("<< shakeShift<<"); aborting." << endl;
-                                        failure = true;
-                                        break;
+                                        composeMessages << expcounter << " Error: shift too large for antiShake ("<< shakeShift<<") at frame " << f << "; aborting." << endl;
+                                        composeFailed = true;
+                                        frameQueue.close();
+                                        return;
                                     }
                                 }
-                                
-                                
                             }
                             
+                            frameQueue.push(f, shakeShift);
+                        }
+                    });
+                    
+                    // presenter: only flips the composed buffers at their deadlines
+                    presenter.raisePriority();
+                    for (int f=0; f<hdrSequence.numFrames; f++) {
+                    
+                        Point2i frameShift;
+                        Mat frontBuff = frameQueue.front(f, frameShift);
+                        if (frontBuff.empty()) {
+                            failure = true;   // compose thread aborted
+                            break;
                         }
                         
-                        
-                        // clear frame
-                        blackFrame.copyTo(screenBuff);
-                        
-                        //calculate required image position and crop rectangle;
-                        Rect availableRegion (0,0,screenBuff.size().width, screenBuff.size().height);
-                        Rect targetRegion = availableRegion + shakeShift ;
-                        Rect intersection = targetRegion & availableRegion;
-                        
-                        
-                        // copy to framebuffer 
-                        hdrFrames[f](intersection - shakeShift ).copyTo( screenBuff( intersection ) );
-                        
-                        sw_stop();
-                        
-                        // 3) wait the rest of the required time to achieve the desired FPS
-                        double took = sw_elapsed_ms();
-                        cout << " took = " << took << endl;
-                        tookAvg += took;
-                        sleep(1.0/(double)hdrSequenceFPS - took/1000.0);
+                        // wait for the deadline and display frame on screen
+                        if (not presenter.wait(f)) {
+                            failure = true;
+                            cout << expcounter << " FAILED due to lag in HDR displaying routine at frame " << f << " (projected " << presenter.projectedEnd() << " ms instead of " << sequenceDuration << " ms)" << endl;
+                            break;
+                        }
+                        imshow("main", frontBuff(shake_viewport(frameShift, hdrPadding, hdrFrameRegion.size())));
+                        waitKey(1);
+                        presenter.presented(f);
+                        frameQueue.flipped(f);
+                    }
+                    
+                    // the last frame stays on screen for a whole frame time as well
+                    if (not failure && not presenter.waitForEnd()) {
+                        failure = true;
+                        cout << expcounter << " FAILED due to lag in HDR displaying routine (projected " << presenter.projectedEnd() << " ms instead of " << sequenceDuration << " ms)" << endl;
                     }
-                    clock(tnow_hdr);
+                    presenter.restorePriority();
+                    frameQueue.close();
+                    composer.join();
+                    cout << composeMessages.str();
+                    if (composeFailed) failure = true;
+                    tracking.setFullResolution(false);
                     
                     imshow("main", blackFrame);
                     waitKey(1);
                     
-                    cout << "took at average " << tookAvg / hdrFrames.size() << " ms (" << 1.0/(tookAvg/1000.0 / hdrFrames.size()) << " max FPS)"<< endl;
-                    double elapsed=elapsed_ms (tlast_hdr, tnow_hdr);
-                    cout << "took a total of " << elapsed << " ms"<< endl;
-                    if (elapsed > 1.05 * (hdrSequenceSize / hdrSequenceFPS * 1000) ) {
-                        failure=true;
-                        cout << expcounter << " FAILED due to lag in HDR displaying routine (took " << elapsed << " ms instead of " <<  (hdrSequenceSize / hdrSequenceFPS * 1000)  << " ms " << endl;
+                    cout << expcounter << " ";
+                    presenter.printStats(cout);
+                    if (dumpTrackingLog) {
+                        logTracking << expcounter << " presented (";
+                        for (int f=0; f<hdrSequence.numFrames; f++) logTracking << " " << presenter.presentationTime(f);
+                        logTracking << " ) end = " << presenter.elapsed() << endl;
                     }
                     
                     
@@ -1139,12 +1220,18 @@ int run (int argc, char* argv[])
                       gpu::min (environment.envMapCompleted, 1.0, environment.envMapCompleted);
                       //gpu::max (environment.envMapCompleted, 0.0, environment.envMapCompleted);
                     #else
-                      environment.envMapRemaining -= environment.envMapUsed.mul(environment.envMapRemaining);
-                      
-                      // dump projected mask
-                      Mat tmp (virtScreenSize, CV_32FC3);
-                      environment.envMapCompleted += environment.envMapUsed;
-                      environment.envMapCompleted = min(environment.envMapCompleted, 1.0);
+                      // envMapUsed is zero outside of the screen footprint, so only those regions change
+                      for (Rect r : environment.dirtyRects) {
+                          Mat used = environment.envMapUsed(r);
+                          Mat remaining = environment.envMapRemaining(r);
+                          Mat completed = environment.envMapCompleted(r);
+                          
+                          subtract(remaining, used.mul(remaining), remaining);
+                          add(completed, used, completed);
+                          min(completed, 1.0, completed);
+                      }
+                      environment.env_modified(environment.envMapRemaining, environment.dirtyRects);
+                      environment.env_modified(environment.envMapCompleted, environment.dirtyRects);
                       
                     #endif
 
@@ -1158,7 +1245,9 @@ int run (int argc, char* argv[])
                                     << "fw ( " << screenCenter(0) << " " << screenCenter(1) << " " << screenCenter(2) << " ) "
                                     << "down ( " << down(0) << " " << down(1) << " " << down(2) << " ) "
                                     << "right ( " << right(0) << " " << right(1) << " " << right(2) << " ) " 
-                                    << "angle = " << screenAngle << " " << endl;
+                                    << "angle = " << screenAngle << " "
+                                    << "stats ( n= " << poseStats.count << " span= " << poseStats.span << " radius= " << poseStats.radius << " diameter= " << poseStats.diameter
+                                    << " jitter= " << poseStats.deviation << " speed= " << poseStats.speed << " angspeed= " << poseStats.angularSpeed << " ) " << endl;
                     }
                     
                     logExposures << expcounter << " " << expFactor << endl;
@@ -1177,15 +1266,14 @@ int run (int argc, char* argv[])
                         
                         if (dumpHDRFrames) {
                             for (int i=0; i<hdrSequenceSize; i++) {
-                                hdrFrames[i].convertTo(hdrFrames[i], CV_8UC3, 255.0, 0);
                                 stringstream ss; ss << outDir << "/screen/frame_" << i << ".bmp";
-                                imwrite (ss.str(),hdrFrames[i]);
+                                imwrite (ss.str(),hdrSequence.frame(i));
                             }
                         }
                             
                         if (dumpTrackingImage) {
                             stringstream ss; ss << outDir << "/tracking/" << expcounter << ".jpg";
-                            imwrite(ss.str(), debugFrame);
+                            imwrite(ss.str(), Tracking::renderDebugImage(debugPose));
                         }    
                         
                         if (dumpEnvMapRemaining) {
@@ -1279,7 +1367,7 @@ int run (int argc, char* argv[])
     destroyWindow("main");
     tracking.stop();
     sleep (0.5);
-    capt.release();
+    source.release();
     if (dumpTrackingLog) logTracking.close();
     logExposures.close();
     
@@ -1315,6 +1403,18 @@ Point2i get_shakeshift (Matx31d& screenCenter, Matx31d& newScreenCenter, Matx31d
 }
 
 
+/**
+    viewport into a padded HDR framebuffer that shows the frame shifted by shakeShift;
+    the shift is clamped to the padding
+*/
+Rect shake_viewport (Point2i shakeShift, Size2i padding, Size screenSize)
+{
+    int x = min(max(shakeShift.x, -padding.width), padding.width);
+    int y = min(max(shakeShift.y, -padding.height), padding.height);
+    return Rect(padding.width - x, padding.height - y, screenSize.width, screenSize.height);
+}
+
+
 int main (int argc, char* argv[])
 {
 
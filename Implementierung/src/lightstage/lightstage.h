@@ -14,12 +14,15 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <thread>
+#include <atomic>
 
 
 #include "util.h"
 #include "tracking.h"
 #include "spherical.h"
 #include "cube.h"
+#include "presenter.h"
 
 
 using namespace std;
@@ -36,6 +39,9 @@ void help();
 int run (int argc, char* argv[]);
 
 Point2i get_shakeshift (Matx31d& screenCenter, Matx31d& newScreenCenter, Matx31d& newDown, Matx31d& newRight, Size2d& screenSizeMm, Size2i& screenSizeNoBorder);
+
+// region of a framebuffer with padding on each side that shows its frame shifted by shakeShift
+Rect shake_viewport (Point2i shakeShift, Size2i padding, Size screenSize);
 /*
 // for communication with display thread
 class displayData {
@@ -0,0 +1,272 @@
+/**
+   lightstage : frame pacing for the HDR sequence display
+
+   Every frame of a sequence contributes the same share of light to the DSLR exposure, so every frame has to be
+   shown for the same time. Frames are scheduled against absolute deadlines on the monotonic clock:
+   a late frame shortens only its predecessor's time on screen instead of shifting the whole rest of the sequence.
+
+   @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "presenter.h"
+
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
+
+using namespace std;
+
+
+// current time on the monotonic clock
+static inline void clock_monotonic (timespec& t)
+{
+    clock_gettime(CLOCK_MONOTONIC, &t);
+}
+
+
+Presenter::Presenter (double fps, int numFrames, double maxDurationMs)
+ :frameTime(1000.0 / fps),
+  numFrames(numFrames),
+  maxDuration(maxDurationMs),
+  presentTimes(numFrames, -1),
+  projected(0),
+  finishTime(-1),
+  priorityRaised(false)
+{
+    startTime.tv_sec = startTime.tv_nsec = 0;
+}
+
+
+/**
+  Start the schedule: frame 0 is due now
+*/
+void Presenter::start ()
+{
+    presentTimes.assign (numFrames, -1);
+    workTimes.clear();
+    projected = numFrames * frameTime;
+    finishTime = -1;
+    clock_monotonic(startTime);
+}
+
+
+// absolute deadline of frame f
+timespec Presenter::deadline (int f)
+{
+    long long ns = (long long)startTime.tv_sec * 1000000000LL + startTime.tv_nsec + (long long)(f * frameTime * 1e6);
+    timespec t;
+    t.tv_sec = ns / 1000000000LL;
+    t.tv_nsec = ns % 1000000000LL;
+    return t;
+}
+
+// ms since start
+double Presenter::since_start (timespec t)
+{
+    return (t.tv_sec - startTime.tv_sec) * 1e3 + (t.tv_nsec - startTime.tv_nsec) / 1e6;
+}
+
+
+/**
+  Sleep until frame f is due. Fails without sleeping if the remaining frames (one frame time each,
+  starting at the deadline or now, whichever is later) would end after maxDuration.
+*/
+bool Presenter::wait (int f)
+{
+    timespec now;
+    clock_monotonic(now);
+    double t = since_start(now);
+    if (f > 0 && presentTimes[f-1] >= 0) workTimes.push_back (t - presentTimes[f-1]);
+
+    projected = max (t, f * frameTime) + (numFrames - f) * frameTime;
+    if (projected > maxDuration) return false;
+
+    #ifdef __APPLE__
+        // no clock_nanosleep: relative sleep for the rest of the time
+        double rest = f * frameTime - t;
+        if (rest > 0) {
+            timespec r;
+            r.tv_sec = (time_t)(rest / 1000.0);
+            r.tv_nsec = (long)((rest - r.tv_sec * 1000.0) * 1e6);
+            while (nanosleep(&r, &r) == -1 && errno == EINTR);
+        }
+    #else
+        timespec due = deadline(f);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+    #endif
+
+    if (f == numFrames) {
+        clock_monotonic(now);
+        finishTime = since_start(now);
+    }
+    return true;
+}
+
+
+/**
+  Record the presentation time of frame f
+*/
+void Presenter::presented (int f)
+{
+    timespec now;
+    clock_monotonic(now);
+    presentTimes[f] = since_start(now);
+}
+
+
+/**
+  Time to the deadline of frame f; negative if it has passed
+*/
+double Presenter::timeUntil (int f)
+{
+    timespec now;
+    clock_monotonic(now);
+    return f * frameTime - since_start(now);
+}
+
+
+/**
+  Realtime scheduling for the calling thread, so flips are not delayed by other threads
+*/
+bool Presenter::priorityDenied = false;
+
+bool Presenter::raisePriority ()
+{
+    if (priorityRaised) return true;
+    if (priorityDenied) return false;
+    pthread_getschedparam (pthread_self(), &oldPolicy, &oldParam);
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (pthread_setschedparam (pthread_self(), SCHED_FIFO, &param) != 0) {
+        cout << "Warning: no realtime priority for the display (missing privileges)" << endl;
+        priorityDenied = true;
+        return false;
+    }
+    priorityRaised = true;
+    return true;
+}
+
+void Presenter::restorePriority ()
+{
+    if (not priorityRaised) return;
+    pthread_setschedparam (pthread_self(), oldPolicy, &oldParam);
+    priorityRaised = false;
+}
+
+
+double Presenter::elapsed ()
+{
+    if (finishTime >= 0) return finishTime;
+    double last = 0;
+    for (int f=0; f<numFrames; f++) last = max (last, presentTimes[f]);
+    return last;
+}
+
+double Presenter::projectedEnd ()
+{
+    return projected;
+}
+
+double Presenter::maxLateness ()
+{
+    double late = 0;
+    for (int f=0; f<numFrames; f++) {
+        if (presentTimes[f] >= 0) late = max (late, presentTimes[f] - f * frameTime);
+    }
+    return late;
+}
+
+double Presenter::frameJitter ()
+{
+    double jitter = 0;
+    for (int f=0; f<numFrames; f++) {
+        if (presentTimes[f] < 0) continue;
+        double next = (f+1 < numFrames) ? presentTimes[f+1] : finishTime;
+        if (next < 0) continue;
+        jitter = max (jitter, fabs (next - presentTimes[f] - frameTime));
+    }
+    return jitter;
+}
+
+double Presenter::meanWorkTime ()
+{
+    if (workTimes.empty()) return 0;
+    double sum = 0;
+    for (unsigned int i=0; i<workTimes.size(); i++) sum += workTimes[i];
+    return sum / workTimes.size();
+}
+
+
+void Presenter::printStats (ostream& out)
+{
+    int shown = 0;
+    for (int f=0; f<numFrames; f++) if (presentTimes[f] >= 0) shown++;
+    double work = meanWorkTime();
+    out << "presented " << shown << " of " << numFrames << " frames in " << elapsed() << " ms (nominal " << numFrames * frameTime << " ms), "
+        << "max lateness " << maxLateness() << " ms, frame jitter " << frameJitter() << " ms, "
+        << "work at average " << work << " ms (" << (work > 0 ? 1000.0 / work : 0) << " max FPS)" << endl;
+}
+
+
+FrameQueue::FrameQueue (Mat buffer0, Mat buffer1)
+ :composed(0),
+  shown(0),
+  closed(false)
+{
+    buffers[0] = buffer0;
+    buffers[1] = buffer1;
+}
+
+
+/**
+  Buffer for frame k; frame k-2 used the same buffer and has to be off screen (frame k-1 was flipped)
+*/
+Mat FrameQueue::back (int k)
+{
+    unique_lock<mutex> guard (queueMutex);
+    while (k >= 2 && shown < k && not closed) queueCond.wait(guard);
+    if (closed) return Mat();
+    return buffers[k%2];
+}
+
+void FrameQueue::push (int k, Point2i offset)
+{
+    {
+        lock_guard<mutex> guard (queueMutex);
+        offsets[k%2] = offset;
+        composed = k+1;
+    }
+    queueCond.notify_all();
+}
+
+
+/**
+  Buffer with frame k, as soon as it is composed
+*/
+Mat FrameQueue::front (int k, Point2i& offset)
+{
+    unique_lock<mutex> guard (queueMutex);
+    while (composed <= k && not closed) queueCond.wait(guard);
+    if (closed) return Mat();
+    offset = offsets[k%2];
+    return buffers[k%2];
+}
+
+void FrameQueue::flipped (int k)
+{
+    {
+        lock_guard<mutex> guard (queueMutex);
+        shown = k+1;
+    }
+    queueCond.notify_all();
+}
+
+
+void FrameQueue::close ()
+{
+    {
+        lock_guard<mutex> guard (queueMutex);
+        closed = true;
+    }
+    queueCond.notify_all();
+}
@@ -0,0 +1,97 @@
+// frame pacing for the HDR sequence display
+
+#ifndef PRESENTER_H
+#define PRESENTER_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+
+#include <iostream>
+#include <vector>
+#include <time.h>
+#include <pthread.h>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+using namespace cv;
+
+
+// Presents numFrames frames with a fixed frame rate. Frame f is due at start + f / fps (absolute deadlines on
+// CLOCK_MONOTONIC), so a late frame does not shift the following ones. The schedule fails as soon as the
+// sequence can no longer end within maxDuration.
+class Presenter {
+
+  public:
+    Presenter (double fps, int numFrames, double maxDurationMs);
+
+    void start ();                  // frame 0 is due now
+
+    // sleep until frame f is due; false if the projected end of the sequence exceeds maxDuration
+    bool wait (int f);
+    bool waitForEnd () { return wait(numFrames); } // until the last frame was shown for one frame time
+
+    void presented (int f);         // frame f is on screen now
+    double timeUntil (int f);       // ms from now to the deadline of frame f (any thread)
+    
+    // run the calling thread with realtime priority (SCHED_FIFO) until restorePriority(); may need privileges
+    bool raisePriority ();
+    void restorePriority ();
+
+    // statistics of the presented frames
+    double presentationTime (int f) { return presentTimes[f]; } // ms since start, -1 if not shown
+    double elapsed ();              // ms from start to the last presented frame or the end
+    double projectedEnd ();         // ms from start to the projected end of the sequence
+    double maxLateness ();          // max. delay of a presentation after its deadline in ms
+    double frameJitter ();          // max. deviation of a frame's duration from 1/fps in ms
+    double meanWorkTime ();         // mean time between a presentation and the next wait() in ms
+    void printStats (ostream& out);
+
+  private:
+    double frameTime;               // ms per frame
+    int numFrames;
+    double maxDuration;             // ms
+    timespec startTime;
+    timespec deadline (int f);
+    double since_start (timespec t);
+
+    vector<double> presentTimes;    // presentation time of each frame (ms since start), -1 if not shown
+    vector<double> workTimes;       // time from a presentation to the next wait()
+    double projected;               // projected end at the last wait() in ms since start
+    double finishTime;              // end of the last frame in ms since start, -1 if not reached
+    
+    bool priorityRaised;
+    static bool priorityDenied;     // realtime priority was refused once (warned), do not ask again
+    int oldPolicy;
+    sched_param oldParam;
+};
+
+
+// Two screen buffers between a compose thread and the presenting thread: frame k is composed into
+// buffer k%2 while frame k-1 is on screen. The compose thread waits until the buffer is off screen,
+// the presenter waits until the frame is composed. Each frame carries the offset it is shown with.
+class FrameQueue {
+
+  public:
+    FrameQueue (Mat buffer0, Mat buffer1);
+
+    // compose thread
+    Mat back (int k);               // buffer for frame k, waits until it is free; empty if the queue was closed
+    void push (int k, Point2i offset);  // frame k is composed, show it with offset
+
+    // presenter
+    Mat front (int k, Point2i& offset); // buffer with frame k, waits until it is composed; empty if the queue was closed
+    void flipped (int k);           // frame k is on screen, the buffer of frame k-1 is free
+
+    void close ();                  // wake up and stop both sides (abort)
+
+  private:
+    Mat buffers[2];
+    Point2i offsets[2];
+    int composed;                   // number of composed frames
+    int shown;                      // number of frames put on screen
+    bool closed;
+    mutex queueMutex;
+    condition_variable queueCond;
+};
+
+#endif // PRESENTER_H
@@ -0,0 +1,248 @@
+/**
+   lightstage : binary SVR container
+
+   The YAML calibration files store one min_N/max_N/response_N key per patch, which takes seconds to parse.
+   The binary container keeps the same data in contiguous float arrays (one block per channel),
+   so it can be memory-mapped and used directly.
+
+   @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "svrfile.h"
+
+#include <fstream>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace cv;
+
+
+// round up to the array alignment
+static inline uint64_t align_offset (uint64_t offset)
+{
+    return (offset + SVR_FILE_ALIGNMENT - 1) / SVR_FILE_ALIGNMENT * SVR_FILE_ALIGNMENT;
+}
+
+
+/**
+  Initialize a header with the given layout; no color transform, exposure unknown
+*/
+SVRFileHeader svr_file_header (Size_<double> screenSize, Size_<double> borderSize, Size patchLayout, double patchSize)
+{
+    SVRFileHeader header;
+    memset (&header, 0, sizeof(header));
+    memcpy (header.magic, SVR_FILE_MAGIC, 4);
+    header.version = SVR_FILE_VERSION;
+    header.patchLayout[0] = patchLayout.width;
+    header.patchLayout[1] = patchLayout.height;
+    header.numPatches = patchLayout.width * patchLayout.height;
+    header.patchSize = patchSize;
+    header.screenSize[0] = screenSize.width;
+    header.screenSize[1] = screenSize.height;
+    header.borderSize[0] = borderSize.width;
+    header.borderSize[1] = borderSize.height;
+    return header;
+}
+
+
+/**
+  Map a binary SVR file into memory and check the header
+*/
+bool SVRFile::open (string filename)
+{
+    close();
+
+    int fd = ::open (filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cout << "Error: cannot open SVR file " << filename << endl;
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SVRFileHeader)) {
+        cout << "Error: SVR file " << filename << " is too small" << endl;
+        ::close(fd);
+        return false;
+    }
+
+    void* mapped = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        cout << "Error: cannot map SVR file " << filename << endl;
+        return false;
+    }
+    data = (const uchar*) mapped;
+    size = st.st_size;
+    header = (const SVRFileHeader*) data;
+
+    // validate header and array bounds
+    const SVRFileHeader& h = *header;
+    uint64_t patchBytes = (uint64_t)h.numPatches * 3 * sizeof(float);
+    bool valid = memcmp(h.magic, SVR_FILE_MAGIC, 4) == 0
+              && h.version == SVR_FILE_VERSION
+              && h.fileSize == size
+              && h.numPatches == (uint32_t)(h.patchLayout[0] * h.patchLayout[1])
+              && h.lutSize > 1
+              && h.offsetMin % SVR_FILE_ALIGNMENT == 0
+              && h.offsetMax % SVR_FILE_ALIGNMENT == 0
+              && h.offsetResponse % SVR_FILE_ALIGNMENT == 0
+              && h.offsetMin >= sizeof(SVRFileHeader)
+              && h.offsetMin + patchBytes <= size
+              && h.offsetMax + patchBytes <= size
+              && h.offsetResponse + patchBytes * h.lutSize <= size;
+
+    if (! valid) {
+        cout << "Error: " << filename << " is not a valid SVR file (version " << SVR_FILE_VERSION << ")" << endl;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+  Unmap the file
+*/
+void SVRFile::close ()
+{
+    if (data != NULL) {
+        munmap ((void*) data, size);
+    }
+    data = NULL;
+    header = NULL;
+    size = 0;
+}
+
+
+/**
+  Read SVR data from a YAML calibration file (keys type, borderSize, screenSize, patchLayout, patchSize,
+  min_N, max_N, response_N and optional colorTransform, exposureTime)
+*/
+bool read_svr_yaml (FileStorage& fs, SVRFileHeader& header, vector<Vec3f>& vMin, vector<Vec3f>& vMax, vector<vector<Vec3f> >& response)
+{
+    // assert that response type is SVR
+    string type;
+    fs["type"] >> type;
+    if (strcasecmp(type.c_str(), "svr") != 0) {
+        cout << "Error: response type is " << type << ", not svr" << endl;
+        return false;
+    }
+
+    Size_<double> borderSize;  fs["borderSize"] >> borderSize;// width/height of vertical/horizontal border
+    Size_<double> screenSize;  fs["screenSize"] >> screenSize;// screen size in pixels
+    Size patchLayout;   fs["patchLayout"] >> patchLayout;   // number of patches in x / y direction
+    double patchSize;   fs["patchSize"] >> patchSize;       // size of one square patch
+
+    header = svr_file_header (screenSize, borderSize, patchLayout, patchSize);
+    fs["exposureTime"] >> header.exposure;
+
+    Mat colorTransMat;  fs["colorTransform"] >> colorTransMat;  // color transformation matrix
+    if (colorTransMat.total() == 9) {
+        Mat tmp;
+        colorTransMat.convertTo (tmp, CV_64F);
+        for (int i=0; i<9; i++) header.colorTransform[i] = tmp.at<double>(i);
+        header.hasColorTransform = 1;
+    }
+
+    // load response curves
+    int size = header.numPatches;
+    vMin.resize(size);
+    vMax.resize(size);
+    response.resize(size);
+
+    for (int n=0; n<size; n++) {
+        stringstream ss;
+        ss << "min_" << n;
+        fs[ss.str().c_str()] >> vMin[n];
+
+        ss.str(string());
+        ss << "max_" << n;
+        fs[ss.str().c_str()] >> vMax[n];
+
+        ss.str(string());
+        ss << "response_" << n;
+        fs[ss.str().c_str()] >> response[n];
+
+        // stdout progress dots
+        if (size >= 10 && n % (size/10) == 0) cout << "." << flush;
+    }
+
+    header.lutSize = (size > 0) ? response[0].size() : 0;
+    return true;
+}
+
+
+/**
+  Write a binary SVR file. All response curves must have the same length.
+*/
+bool write_svr_file (string filename, SVRFileHeader header, const vector<Vec3f>& vMin, const vector<Vec3f>& vMax, const vector<vector<Vec3f> >& response)
+{
+    uint32_t numPatches = response.size();
+    uint32_t lutSize = (numPatches > 0) ? response[0].size() : 0;
+
+    if (numPatches != header.numPatches || vMin.size() != numPatches || vMax.size() != numPatches) {
+        cout << "Error: number of patches does not match the patch layout" << endl;
+        return false;
+    }
+    for (uint32_t p=0; p<numPatches; p++) {
+        if (response[p].size() != lutSize) {
+            cout << "Error: response curve " << p << " has " << response[p].size() << " instead of " << lutSize << " entries" << endl;
+            return false;
+        }
+    }
+
+    // array offsets
+    memcpy (header.magic, SVR_FILE_MAGIC, 4);
+    header.version = SVR_FILE_VERSION;
+    header.lutSize = lutSize;
+    header.offsetMin = align_offset (sizeof(SVRFileHeader));
+    header.offsetMax = align_offset (header.offsetMin + (uint64_t)numPatches * 3 * sizeof(float));
+    header.offsetResponse = align_offset (header.offsetMax + (uint64_t)numPatches * 3 * sizeof(float));
+    header.fileSize = header.offsetResponse + (uint64_t)numPatches * 3 * lutSize * sizeof(float);
+
+    ofstream of (filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if (! of.is_open()) {
+        cout << "Error: cannot write SVR file " << filename << endl;
+        return false;
+    }
+
+    const char zeros[SVR_FILE_ALIGNMENT] = { 0 };
+
+    of.write ((const char*) &header, sizeof(header));
+    of.write (zeros, header.offsetMin - sizeof(header));
+
+    // vMin, vMax: [channel][patch]
+    vector<float> row (numPatches);
+    for (int c=0; c<3; c++) {
+        for (uint32_t p=0; p<numPatches; p++) row[p] = vMin[p][c];
+        of.write ((const char*) &row[0], numPatches * sizeof(float));
+    }
+    of.write (zeros, header.offsetMax - (header.offsetMin + numPatches * 3 * sizeof(float)));
+
+    for (int c=0; c<3; c++) {
+        for (uint32_t p=0; p<numPatches; p++) row[p] = vMax[p][c];
+        of.write ((const char*) &row[0], numPatches * sizeof(float));
+    }
+    of.write (zeros, header.offsetResponse - (header.offsetMax + numPatches * 3 * sizeof(float)));
+
+    // response: [channel][patch][lutIndex]
+    vector<float> curve (lutSize);
+    for (int c=0; c<3; c++) {
+        for (uint32_t p=0; p<numPatches; p++) {
+            for (uint32_t i=0; i<lutSize; i++) curve[i] = response[p][i][c];
+            of.write ((const char*) &curve[0], lutSize * sizeof(float));
+        }
+    }
+
+    of.close();
+    if (of.fail()) {
+        cout << "Error: writing SVR file " << filename << " failed" << endl;
+        return false;
+    }
+    return true;
+}
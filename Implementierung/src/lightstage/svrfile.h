@@ -0,0 +1,84 @@
+// binary container for spatially varying response (SVR) calibration data
+
+#ifndef SVRFILE_H
+#define SVRFILE_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+using namespace cv;
+
+
+#define SVR_FILE_MAGIC "SVRB"
+#define SVR_FILE_VERSION 1
+#define SVR_FILE_ALIGNMENT 64           // alignment of the data arrays in bytes
+
+// File layout (little endian): header, followed by three float arrays at 64 byte aligned offsets
+//   vMin      [channel][patch]
+//   vMax      [channel][patch]
+//   response  [channel][patch][lutIndex]  (inverted response curves)
+// channels are in OpenCV (BGR) order
+struct SVRFileHeader {
+    char magic[4];                      // SVR_FILE_MAGIC
+    uint32_t version;                   // SVR_FILE_VERSION
+    uint32_t numPatches;                // patchLayout width * height
+    uint32_t lutSize;                   // number of entries per response curve
+    int32_t patchLayout[2];             // number of patches in x / y direction
+    double patchSize;                   // edge length of the square patches in pixels
+    double screenSize[2];               // native screen size in pixels
+    double borderSize[2];               // border size in pixels (vertical, horizontal)
+    double exposure;                    // exposure time used for calibration; 0 if unknown
+    uint32_t hasColorTransform;         // 1 if colorTransform is valid
+    uint32_t reserved;
+    double colorTransform[9];           // color transformation matrix (cam_channels -> disp_channels), row major
+    uint64_t offsetMin;                 // byte offsets of the arrays from the start of the file
+    uint64_t offsetMax;
+    uint64_t offsetResponse;
+    uint64_t fileSize;                  // total file size in bytes
+};
+
+
+// memory-mapped, read-only access to a binary SVR file
+class SVRFile {
+
+  public:
+    SVRFile () : header(NULL), data(NULL), size(0) {}
+    ~SVRFile () { close(); }
+
+    // map the file and validate the header; prints an error and returns false on failure
+    bool open (string filename);
+    void close ();
+
+    // per channel arrays
+    const float* vMin (int channel) const { return (const float*) (data + header->offsetMin) + channel * header->numPatches; }
+    const float* vMax (int channel) const { return (const float*) (data + header->offsetMax) + channel * header->numPatches; }
+    const float* response (int channel, int patch) const
+    {
+        return (const float*) (data + header->offsetResponse) + ((size_t)channel * header->numPatches + patch) * header->lutSize;
+    }
+
+    const SVRFileHeader* header;
+    const uchar* data;                  // mapped file
+    size_t size;
+
+  private:
+    // no copies of the mapping
+    SVRFile (const SVRFile&);
+    SVRFile& operator= (const SVRFile&);
+};
+
+
+// SVR data as stored in the YAML calibration files (one interleaved BGR curve per patch)
+bool read_svr_yaml (FileStorage& fs, SVRFileHeader& header, vector<Vec3f>& vMin, vector<Vec3f>& vMax, vector<vector<Vec3f> >& response);
+
+// write a binary SVR file; layout fields of the header are taken as given, the rest is filled in
+bool write_svr_file (string filename, SVRFileHeader header, const vector<Vec3f>& vMin, const vector<Vec3f>& vMax, const vector<vector<Vec3f> >& response);
+
+// initialize a header with the layout; no color transform, exposure unknown
+SVRFileHeader svr_file_header (Size_<double> screenSize, Size_<double> borderSize, Size patchLayout, double patchSize);
+
+#endif // SVRFILE_H
@@ -0,0 +1,129 @@
+/**
+   lightstage : precompiled spatially varying response
+
+   Bakes the patch selection and interpolation weights of apply_response_svr_subpixel() into a table,
+   so the per-pixel inverse response in the HDR frame loop only has to do the curve lookups.
+
+   @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "svrtable.h"
+
+using namespace std;
+using namespace cv;
+
+
+/**
+  Precompute the four interpolation taps for every pixel of a screen with the given size.
+  Uses the same four cases (corners, vertical edges, horizontal edges, inner region) as apply_response_svr_subpixel().
+*/
+void SVRTable::build (SVRInfo& svr, Size screenSize)
+{
+    width = screenSize.width;
+    height = screenSize.height;
+
+    // per patch: response curve and value range
+    for (int c=0; c<3; c++) {
+        curve[c].resize(svr.size);
+        vMin[c].assign(svr.minValues(c), svr.minValues(c) + svr.size);
+        vMax[c].assign(svr.maxValues(c), svr.maxValues(c) + svr.size);
+        lutScale[c].resize(svr.size);
+        const float* invRange = svr.invRanges(c);
+        for (int p=0; p<svr.size; p++) {
+            curve[c][p] = svr.curve(c, p);
+            lutScale[c][p] = (svr.lutSize-1) * invRange[p];
+        }
+    }
+
+    // per pixel: interpolation taps
+    for (int k=0; k<4; k++) {
+        patch[k].resize(width*height);
+        weight[k].resize(width*height);
+    }
+
+    double w = svr.screenSize.width - 2*svr.borderSize.width;
+    double h = svr.screenSize.height - 2*svr.borderSize.height;
+    double ps = svr.patchSize;
+    int numx = svr.patchLayout.width;
+
+    for (int iy=0; iy<height; iy++) {
+        for (int ix=0; ix<width; ix++) {
+
+            // patch index and pixel position within patch
+            int x = floor ( (double)ix / ps);
+            int y = floor ( (double)iy / ps);
+            double px = fmod ((double)ix, ps);
+            double py = fmod ((double)iy, ps);
+
+            bool innerX = (ix >= ps/2.0 && ix <= w-1 - ps/2);
+            bool innerY = (iy >= ps/2 && iy <= h-1 - ps/2);
+
+            int idx[4];
+            float wt[4] = { 0, 0, 0, 0 };
+
+            // 0) no interpolation (corners)
+            if (!innerX && !innerY) {
+                idx[0] = idx[1] = idx[2] = idx[3] = y*numx + x;
+                wt[0] = 1;
+
+            // 1) only vertical interpolation (vertical edges)
+            } else if (!innerX && innerY) {
+                int a = (py < ps / 2) ? y-1 : y;  // above neighbor y position
+                double fy = (iy - (a*ps + ps/2.0)) / ps;
+                idx[0] = idx[1] = a*numx + x;
+                idx[2] = idx[3] = (a+1)*numx + x;
+                wt[0] = 1-fy;
+                wt[2] = fy;
+
+            // 2) only horizontal interpolation required (horizontal edges)
+            } else if (!innerY && innerX) {
+                int l = (px < ps / 2) ? x-1 : x;  // left neighbor x position
+                double fx = (ix - (l*ps + ps/2.0)) / ps;
+                idx[0] = idx[2] = y*numx + l;
+                idx[1] = idx[3] = y*numx + l+1;
+                wt[0] = 1-fx;
+                wt[1] = fx;
+
+            // 3) bilinear interpolation (most of the pixels)
+            } else {
+                int l = (px < ps / 2) ? x-1 : x;  // left neighbor x position
+                int a = (py < ps / 2) ? y-1 : y;  // above neighbor y position
+                double fx = (ix - (l*ps + ps/2.0)) / ps;
+                double fy = (iy - (a*ps + ps/2.0)) / ps;
+                idx[0] = a*numx + l;            // top left
+                idx[1] = a*numx + l+1;          // top right
+                idx[2] = (a+1)*numx + l;        // bottom left
+                idx[3] = (a+1)*numx + l+1;      // bottom right
+                wt[0] = (1-fx)*(1-fy);
+                wt[1] = fx*(1-fy);
+                wt[2] = (1-fx)*fy;
+                wt[3] = fx*fy;
+            }
+
+            int i = iy*width + ix;
+            for (int k=0; k<4; k++) {
+                patch[k][i] = idx[k];
+                weight[k][i] = wt[k];
+            }
+        }
+    }
+}
+
+
+/**
+  apply inverse response to all pixels of an image
+*/
+void SVRTable::apply (Mat& img) const
+{
+    assert (img.size().width == width && img.size().height == height);
+
+    Vec3f *ps;  // pointer to a data row
+    for (int y=0; y<height; y++) {
+        ps = img.ptr<Vec3f>(y);
+        for (int x=0; x<width; x++) {
+            ps[x][0] = apply(ps[x][0], x, y, 0);
+            ps[x][1] = apply(ps[x][1], x, y, 1);
+            ps[x][2] = apply(ps[x][2], x, y, 2);
+        }
+    }
+}
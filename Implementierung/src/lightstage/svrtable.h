@@ -0,0 +1,60 @@
+// precompiled spatially varying response (per-pixel interpolation table)
+
+#ifndef SVRTABLE_H
+#define SVRTABLE_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+
+#include <iostream>
+#include <vector>
+
+#include "util.h"
+
+using namespace std;
+using namespace cv;
+
+
+// Bakes the patch lookup of apply_response_svr_subpixel() for a fixed screen size.
+// For every pixel we store the (up to) four neighboring patches and their bilinear weights,
+// so the inverse response becomes four curve lookups and a weighted sum.
+class SVRTable {
+
+  public:
+    SVRTable () : width(0), height(0) {}
+
+    // precompute patch indices and weights for every pixel of a screen with the given size
+    void build (SVRInfo& svr, Size screenSize);
+
+    // inverse response for one subpixel; same result as apply_response_svr_subpixel()
+    inline float apply (float val, int x, int y, int c) const
+    {
+        const int i = y*width + x;
+        float res = 0;
+        for (int k=0; k<4; k++) {
+            const int p = patch[k][i];
+            float v;
+            if (val < vMin[c][p]) v = 0;        // minimum light output reached
+            else if (val > vMax[c][p]) v = 1;   // maximum light output reached
+            else v = curve[c][p][(int)((val - vMin[c][p]) * lutScale[c][p] + 0.5f)];
+            res += weight[k][i] * v;
+        }
+        return res;
+    }
+
+    // apply inverse response to all pixels of an image (same as apply_response_svr)
+    void apply (Mat& img) const;
+
+    int width, height;                  // screen size the table was built for
+
+    // per pixel: four taps as structure of arrays (tl, tr, bl, br)
+    vector<int> patch[4];               // patch index of the tap
+    vector<float> weight[4];            // interpolation weight of the tap (sums up to 1)
+
+    // per patch
+    vector<const float*> curve[3];      // inverted response curve per channel (points into SVRInfo::response)
+    vector<float> vMin[3];              // minimal rel. radiance per channel
+    vector<float> vMax[3];              // maximal rel. radiance per channel
+    vector<float> lutScale[3];          // (lut size - 1) / (vMax - vMin)
+};
+
+#endif // SVRTABLE_H
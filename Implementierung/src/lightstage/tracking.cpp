@@ -5,42 +5,81 @@
 using namespace std;
 using namespace cv;
 
-// webcam frame size
-#ifdef __APPLE__
-  #define VIDEO_WIDTH  1280
-  #define VIDEO_HEIGHT  720
-#else
-  #define VIDEO_WIDTH  640
-  #define VIDEO_HEIGHT 480
-#endif
+
+// intrinsics for an image scaled by sx, sy (pixel centers at integer coordinates, as in pyrDown / resize)
+static Mat scale_camera_matrix (const Mat& camMat, double sx, double sy)
+{
+    Mat scaled = camMat.clone();
+    scaled.at<double>(0,0) *= sx;
+    scaled.at<double>(1,1) *= sy;
+    scaled.at<double>(0,2) = (camMat.at<double>(0,2) + 0.5) * sx - 0.5;
+    scaled.at<double>(1,2) = (camMat.at<double>(1,2) + 0.5) * sy - 0.5;
+    return scaled;
+}
 
  
 // constructor
-Tracking::Tracking (VideoCapture& camCapture, 
+Tracking::Tracking (FrameSource& frameSource, 
                     string camParamsFile, 
                     string markerConfigFile,
                     int threshold, 
                     bool greyscale,
-                    bool inverted)
- :capt(camCapture),
-  lock(false),
-  readerLock(false),
+                    bool inverted,
+                    bool undistortPoints,
+                    Size resolution)
+ :source(frameSource),
+  opened(false),
+  idleLevel(0),
+  level(0),
+  fullResolution(false),
+  running(false),
+  trackingEnded(true),
+  slotIndex(0),
+  slotFull(false),
+  grabEnded(false),
+  droppedFrames(0),
+  poseBack(0),
+  poseFront(1),
+  poseMiddle(2),
+  poseSeq(0),
+  readSeq(0),
+  useUndistortPoints(undistortPoints),
+  useROI(false),
+  roiFullSearchInterval(0),
+  roiFrameCount(0),
   useInverted(inverted),
   useGreyscale(greyscale), 
   thresh(threshold), 
+  useAutoThreshold(false),
+  autoThresholdInterval(0),
+  autoThresholdCount(0),
+  markerDetected(false),
   err(0), 
-  hasNew(false), 
+  lastPositionsHead(-1),
+  lastPositionsCount(0),
+  statsWindow(10),
+  positionSum(0,0,0),
+  positionSqSum(0,0,0),
   debug(true)//,
   //stageTransMat(stageTransMat)
 {
     cout << "initializing trackin class" << endl;
+    #if AR_PIX_SIZE_DEFAULT == 1
+        // ARToolKit built with AR_PIXEL_FORMAT_MONO only accepts luminance images
+        useGreyscale = true;
+    #endif
     cout << "using " << (useInverted?"inverted ":"") << (useGreyscale?"greyscale":"color") << " image";
-    // read first frame for size
-    capt >> frame;
+    // request the tracking resolution (empty: camera default), read first frame for size
+    source.setResolution(resolution);
+    if (not source.read(frame, tcapture, frameIndex) || frame.empty()) {
+        cout << "Error: no frame from the frame source" << endl;
+        return;
+    }
     clock(tlast);
-    if (not (frame.size().width == VIDEO_WIDTH && frame.size().height == VIDEO_HEIGHT)) {
-        cout << "error: video frame size of " << VIDEO_WIDTH << " x " << VIDEO_HEIGHT << " does not match the video stream of " << frame.size().width << " x " << frame.size().height << endl;
-        exit(-1);
+    tread = tlast;
+    for (int i=0; i<3; i++) poseSlots[i].time = poseSlots[i].captureTime = poseSlots[i].readTime = tlast;
+    if (resolution.area() > 0 && frame.size() != resolution) {
+        cout << "warning: camera delivers " << frame.size().width << " x " << frame.size().height << " instead of the requested " << resolution.width << " x " << resolution.height << endl;
     }
     
     //
@@ -52,42 +91,33 @@ Tracking::Tracking (VideoCapture& camCapture,
     FileStorage fs(camParamsFile, FileStorage::READ);
     fs["camera_matrix"] >> cameraMatrix;
     fs["distortion_coefficients"] >> distCoeffs;
+    Size calibSize;
+    fs["image_width"] >> calibSize.width;
+    fs["image_height"] >> calibSize.height;
     fs.release();
     
-    // calculate undistort maps
-    initUndistortRectifyMap(cameraMatrix, distCoeffs, Mat(), cameraMatrix, frame.size(), CV_16SC2, map1, map2);
-
-    cout << "compilation time video frame size is " << VIDEO_WIDTH << " " << VIDEO_HEIGHT << endl;
+    // scale intrinsics if the camera was calibrated with another resolution
+    if (calibSize.area() > 0 && calibSize != frame.size()) {
+        cout << "scaling camera parameters from " << calibSize.width << " x " << calibSize.height << " to " << frame.size().width << " x " << frame.size().height << endl;
+        if (abs((double)calibSize.width / calibSize.height - (double)frame.size().width / frame.size().height) > 0.01) {
+            cout << "warning: aspect ratio differs from the calibration, the camera may crop the image" << endl;
+        }
+        cameraMatrix = scale_camera_matrix(cameraMatrix, (double)frame.size().width / calibSize.width, (double)frame.size().height / calibSize.height);
+    }
+    
+    cout << "video frame size is " << frame.size().width << " " << frame.size().height << endl;
     
     // calculate FOV
-    double fov_theta_x = 2 * atan2( (VIDEO_WIDTH / 2),  cameraMatrix.at<double>(0,0)) / M_PI * 180.0;
-    double fov_theta_y = 2 * atan2( (VIDEO_HEIGHT / 2), cameraMatrix.at<double>(1,1)) / M_PI * 180.0;
+    double fov_theta_x = 2 * atan2( (frame.size().width / 2.0),  cameraMatrix.at<double>(0,0)) / M_PI * 180.0;
+    double fov_theta_y = 2 * atan2( (frame.size().height / 2.0), cameraMatrix.at<double>(1,1)) / M_PI * 180.0;
     cout << "tracking cam FOV is " << fov_theta_x << " x " << fov_theta_y << " degree" << endl;
     
-    //
-    // set up ARToolKit camera parameters
-    //
-    
-    cameraParam.xsize=VIDEO_WIDTH;
-    cameraParam.ysize=VIDEO_HEIGHT;
-    
-    
-    // convert OpenCV camera matrix to artoolkit array
-    for (int i=0; i<3; i++) {
-        for (int j=0; j<3; j++) {
-            cameraParam.mat[i][j] = cameraMatrix.at<double>(i,j); 
-        }
-        // is 3x4 array: 0,0,0 tralation
-        cameraParam.mat[i][3] = 0;
-    }
-    
-    // 'identity' distortion factor (has no effect)
-    cameraParam.dist_factor[0] = 0;
-    cameraParam.dist_factor[1] = 0;
-    cameraParam.dist_factor[2] = 0;
-    cameraParam.dist_factor[3] = 1;
- 
-    arInitCparam(&cameraParam);
+    // full resolution level: undistort maps and ARToolKit camera parameters
+    levels.resize(1);
+    levels[0].size = frame.size();
+    levels[0].cameraMatrix = cameraMatrix;
+    initLevel(0);
+    useLevel(0);
         
     cout << "ARToolKit image size is " << arImXsize << " " << arImYsize << endl;
     //
@@ -95,8 +125,10 @@ Tracking::Tracking (VideoCapture& camCapture,
     //
     if( (config = arMultiReadConfigFile(markerConfigFile.c_str())) == NULL  ) {
         cout << "Error while loading multi AR marker config " << markerConfigFile  << endl;
-        capt.release();
+        source.release();
+        return;
     }
+    opened = true;
  
  }
 
@@ -106,6 +138,26 @@ Tracking::~Tracking ()
     stop();
 }
 
+// marker detection and position calculation on the whole frame with threshold t;
+// returns false if no position was found
+bool Tracking::evaluateThreshold (int t, int& numMarkers, double& error)
+{
+    numMarkers = 0;
+    error = -1;
+    if (arDetectMarker((ARUint8 *)frame.data, effectiveThreshold(t), &markerInfo, &markerNum) < 0) return false;
+    if (useUndistortPoints) undistortMarkers();
+    error = arMultiGetTransMat(markerInfo, markerNum, config);
+    
+    for (int i=0; i<config->marker_num; i++ ) {
+        if (config->marker[i].visible != -1) numMarkers++;
+    }
+    if (error < 0 || numMarkers == 0) return false;
+    
+    error /= (float)numMarkers;
+    return true;
+}
+
+
 // find best threshold
 // return true if a new best threshold was found
 bool Tracking::runAutoThreshold()
@@ -113,30 +165,20 @@ bool Tracking::runAutoThreshold()
     double minErr = 1E10;
     int bestThresh = -1;
     
-    readerLock = true;
-    
-    int numMarkersUsed;
     for (int t=0; t<256; t++) {
-        arDetectMarker((ARUint8 *)frame.data, t, &markerInfo, &markerNum);
-        double err = arMultiGetTransMat(markerInfo, markerNum, config);
-        
-        numMarkersUsed = 0;
-        for (int i=0; i<config->marker_num; i++ ) {
-            if (config->marker[i].visible != -1) numMarkersUsed++;
-        }
-        
-        if (numMarkersUsed < 4 ) continue;
+        int numMarkers;
+        double err;
+        if (not evaluateThreshold (t, numMarkers, err)) continue;
         
-        err /= (float)numMarkersUsed;
+        if (numMarkers < 4 ) continue;
         
         if (err >= 0 && err < minErr ) { 
             minErr = err;
             bestThresh = t;
-            cout << " thresh=" << thresh << "  err = " << err << endl;
+            cout << " thresh=" << t << "  err = " << err << endl;
         }
         
     }
-    readerLock = false;
     if (bestThresh == -1) { 
         cout << "Autothreshold found nothing" << endl; 
         return false;
@@ -150,116 +192,640 @@ bool Tracking::runAutoThreshold()
 }
 
 
-// start/stop tracking thread
+// start/stop tracking threads
 void Tracking::start()
 {
+    if (not opened) return;
     running = true;
-    lock = false;
-    pthread_t thread;
-    pthread_create (&thread, NULL, trackingLoop, this);
+    trackingEnded = false;
+    pthread_create (&grabThread, NULL, grabLoop, this);
+    pthread_create (&trackingThread, NULL, trackingLoop, this);
         
 }
 void Tracking::stop()
 {
-    running = false;
+    if (not running) return;
+    {
+        lock_guard<mutex> guard (slotMutex);
+        running = false;
+    }
+    slotCond.notify_all();
+    pthread_join (grabThread, NULL);
+    pthread_join (trackingThread, NULL);
+}
+
+// infinite loop: grab frames as fast as the camera delivers them
+void* Tracking::grabLoop(void *ptr)
+{
+    Tracking* t = reinterpret_cast<Tracking*>(ptr);
+    while (t->running) {
+        if (not t->grab() && t->source.isReplay()) break;
+    }
+    
+    // let the tracking thread finish the last frame
+    {
+        lock_guard<mutex> guard (t->slotMutex);
+        t->grabEnded = true;
+    }
+    t->slotCond.notify_all();
+    return NULL;
 }
 
-// infinite loop: grab frame, detect marker, calculate position
-// only limited by camera input framerate (waits for next frame delivered by opencv)
+// infinite loop: take latest frame, detect marker, calculate position
+// only limited by camera input framerate; frames that arrive during a detection replace each other
 void* Tracking::trackingLoop(void *ptr)
 {
     cout << "tracking loop started" << endl;
     Tracking* t = reinterpret_cast<Tracking*>(ptr);
     while (t->running) {
     
-        // grab next frame ( waits until new frame is available, sets lock=true after image was aquired )
-        t->grab();
-        
-        // wait until shared ressources are no longer accessed
-        while (t->readerLock) {} 
+        // wait for the next frame, undistort etc.
+        if (not t->takeFrame()) break;
+        t->preprocess();
         
         // detect marker and calculate position
-        t->hasNew = t->detect();
+        bool found = t->detect();
         
-        // create tracking debug image
-        if (t->debug) t->createDebugImage();
-    
-        t->lock = false;
+        // update motion model and hand the new position over to the reader
+        if (found) {
+            t->updateMotion();
+            t->updateStats();
+            t->publishPose();
+        }
+        
+        // follow lighting changes
+        if (t->useAutoThreshold && (not found || ++t->autoThresholdCount >= t->autoThresholdInterval)) {
+            t->adaptThreshold(found);
+            t->autoThresholdCount = 0;
+        }
+        
+        // the reader may render the published frame at any time
+        if (found && t->debug) t->releaseFrames();
         
     }
     
+    t->trackingEnded = true;
     cout << "tracking loop ended" << endl;
     return NULL; // supress warning
 }
 
-// grab next frame, undistort and apply greyscale and value inversion
+// grab next frame and put it into the slot (replaces a frame that was not taken yet)
 bool Tracking::grab() 
 {
-    if (!capt.grab()) {
-        cout << "Error capturing video frame" << endl;
-        return false;
+    timespec t, tr;
+    unsigned long index;
+    if (not source.read(grabFrame, t, index)) return false;
+    clock(tr);
+    
+    {
+        unique_lock<mutex> guard (slotMutex);
+        
+        // lossless replay: every frame is detected
+        while (source.isLossless() && slotFull && running) slotCond.wait(guard);
+        
+        if (slotFull) droppedFrames++;
+        swap (grabFrame, slotFrame);
+        slotTime = t;
+        slotReadTime = tr;
+        slotIndex = index;
+        slotFull = true;
     }
-    lock = true;
+    slotCond.notify_all();
+    return true;
+}
+
+// wait for a new frame in the slot and take it
+bool Tracking::takeFrame()
+{
+    {
+        unique_lock<mutex> guard (slotMutex);
+        while (not slotFull && not grabEnded && running) slotCond.wait(guard);
+        if (not slotFull) return false;
+        
+        swap (slotFrame, rawFrame);
+        tcapture = slotTime;
+        tread = slotReadTime;
+        frameIndex = slotIndex;
+        slotFull = false;
+    }
+    slotCond.notify_all();  // a lossless replay waits for the empty slot
+    return true;
+}
+
+// detect on a downscaled pyramid level while not in full resolution mode
+void Tracking::setPyramidLevel (int l)
+{
+    idleLevel = max(l, 0);
+    for (int i=levels.size(); i<=idleLevel; i++) {
+        Level next;
+        next.size = Size((levels[i-1].size.width+1) / 2, (levels[i-1].size.height+1) / 2);  // pyrDown size
+        next.cameraMatrix = scale_camera_matrix(levels[0].cameraMatrix, 
+                                                (double)next.size.width / levels[0].size.width, 
+                                                (double)next.size.height / levels[0].size.height);
+        levels.push_back(next);
+        initLevel(i);
+    }
+    pyramid.resize(levels.size());
+}
+
+// undistort maps and ARToolKit camera parameters of a level (size and camera matrix must be set)
+void Tracking::initLevel (int l)
+{
+    Level& lv = levels[l];
     
-    capt.retrieve(frame);
+    // the distortion coefficients do not depend on the image size
+    initUndistortRectifyMap(lv.cameraMatrix, distCoeffs, Mat(), lv.cameraMatrix, lv.size, CV_16SC2, lv.map1, lv.map2);
     
+    lv.param.xsize = lv.size.width;
+    lv.param.ysize = lv.size.height;
     
-            
-    // undistort image
-    remap(frame,frame, map1, map2, INTER_LINEAR);
+    // convert OpenCV camera matrix to artoolkit array
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<3; j++) {
+            lv.param.mat[i][j] = lv.cameraMatrix.at<double>(i,j); 
+        }
+        // is 3x4 array: 0,0,0 tralation
+        lv.param.mat[i][3] = 0;
+    }
+    
+    // 'identity' distortion factor (has no effect)
+    lv.param.dist_factor[0] = 0;
+    lv.param.dist_factor[1] = 0;
+    lv.param.dist_factor[2] = 0;
+    lv.param.dist_factor[3] = 1;
+}
 
-    // POSSIBLE SPEEDUP: use single-channel images with artoolkit
-    // convert to grey scale
-    if (useGreyscale) {
-        Mat grey; cvtColor(frame,grey,CV_BGR2GRAY);
-        Mat gchannels[3] = {grey,grey,grey};
-        merge(gchannels, 3, frame);
+// make l the current level: intrinsics, undistort maps and ARToolKit image size
+void Tracking::useLevel (int l)
+{
+    level = l;
+    cameraMatrix = levels[l].cameraMatrix;
+    map1 = levels[l].map1;
+    map2 = levels[l].map2;
+    cameraParam = levels[l].param;
+    arInitCparam(&cameraParam);
+    if (debug) cout << "tracking resolution is " << levels[l].size.width << " x " << levels[l].size.height << endl;
+}
+
+// image downscaled to the current level; the buffers are kept per level
+Mat Tracking::downscale (const Mat& img)
+{
+    if (level == 0) return img;
+    pyrDown (img, pyramid[1]);
+    for (int l=2; l<=level; l++) {
+        pyrDown (pyramid[l-1], pyramid[l]);
     }
+    return pyramid[level];
+}
 
-    // POSSIBLE SPEEDUP: inplace inversion
-    if (useInverted) {
-        frame = Mat(frame.size(), CV_8UC3, CV_RGB(255,255,255)) - frame;
-    }    
+// downscale, undistort and apply greyscale and value inversion
+void Tracking::preprocess() 
+{
+    // switch the level requested by the reader
+    int l = fullResolution ? 0 : idleLevel;
+    if (l != level) useLevel(l);
     
-    return true;
+    if (useGreyscale) {
+    
+        // convert to grey scale first, so downscaling, undistortion and inversion only process one plane
+        cvtColor(rawFrame, rawGrey, CV_BGR2GRAY);
+        if (useUndistortPoints) {
+            grey = downscale(rawGrey);
+        } else {
+            remap(downscale(rawGrey), grey, map1, map2, INTER_LINEAR);
+        }
+        if (useInverted) bitwise_not(grey, grey);
+        
+        #if AR_PIX_SIZE_DEFAULT == 1
+            // ARToolKit built with AR_PIXEL_FORMAT_MONO: detect on the luminance plane directly
+            frame = grey;
+        #else
+            // ARToolKit expects its multi-channel default format
+            Mat gchannels[3] = {grey,grey,grey};
+            merge(gchannels, 3, frame);
+        #endif
+        
+    } else {
+    
+        // undistort image
+        if (useUndistortPoints) {
+            frame = downscale(rawFrame);
+        } else {
+            remap(downscale(rawFrame), frame, map1, map2, INTER_LINEAR);
+        }
+        if (useInverted) bitwise_not(frame, frame);
+    }
 }
 
 double Tracking::lastTime() 
 {
     timespec tnow;
     clock(tnow);
-    return elapsed_ms(tlast, tnow);
+    timespec tpose = latestPose().time;
+    return elapsed_ms(tpose, tnow);
 }
 
 
-bool Tracking::hasNewData()
+// copy the current tracking information into the back slot and make it the middle slot
+void Tracking::publishPose()
 {
-   // while (lock) {} ; 
-    if (hasNew) { 
-        hasNew = false; 
-        return true;
+    TrackingPose& pose = poseSlots[poseBack];
+    pose.transMat = transMat;
+    pose.rotMat = rotMat;
+    pose.camPos = camPos;
+    pose.err = err;
+    pose.numMarkers = numMarkersUsed;
+    pose.seq = ++poseSeq;
+    pose.droppedFrames = droppedFrames;
+    pose.frameIndex = frameIndex;
+    pose.captureTime = tcapture;
+    pose.readTime = tread;
+    pose.time = tlast;
+    pose.velocity = velocity;
+    pose.angularVelocity = angularVelocity;
+    pose.stats = stats;
+    if (debug) {
+        collectDebugData(pose.debug);
+    } else {
+        pose.debug = TrackingDebugData();
+    }
+    
+    // recording / benchmark
+    if (source.isLoggingPoses()) {
+        FramePose logged;
+        logged.index = frameIndex;
+        logged.err = err;
+        logged.numMarkers = numMarkersUsed;
+        logged.latency = elapsed_ms(tread, tlast);
+        logged.droppedFrames = pose.droppedFrames;
+        logged.level = level;
+        logged.camPos = camPos;
+        Rodrigues (rotMat, logged.rotVec);
+        source.logPose(logged);
+    }
+    
+    poseBack = poseMiddle.exchange (poseBack | POSE_NEW, memory_order_acq_rel) & 3;
+}
+
+
+// take over the middle slot if it holds a pose that was not read yet
+const TrackingPose& Tracking::latestPose()
+{
+    if (poseMiddle.load (memory_order_relaxed) & POSE_NEW) {
+        poseFront = poseMiddle.exchange (poseFront, memory_order_acq_rel) & 3;
     }
-    return false;
-} 
+    return poseSlots[poseFront];
+}
+
 
-bool Tracking::hasStablePosition (int n, double maxDist)
+// constant velocity extrapolation of the latest pose
+TrackingPose Tracking::predictPose (timespec t)
 {
-    if (n > (int)lastPositions.size()) return false; // not enough last positions
+    TrackingPose pose = latestPose();
+    if (pose.seq == 0) return pose;
     
-    // naive: check distance between all pairs of the n last positions
+    double dt = elapsed_ms (pose.captureTime, t);
+    dt = min (max (dt, 0.0), (double)maxPredictionMs);
+    
+    pose.camPos = pose.camPos + pose.velocity * dt;
+    Matx33d dR;
+    Rodrigues (pose.angularVelocity * dt, dR);
+    pose.rotMat = dR * pose.rotMat;
+    
+    // world -> camera transformation of the predicted pose
+    Matx33d rotInv = pose.rotMat.t();
+    Matx31d trans = -rotInv * pose.camPos;
+    for (int j=0; j<3; j++) {
+        for (int i=0; i<3; i++) {
+            pose.transMat(j,i) = rotInv(j,i);
+        }
+        pose.transMat(j,3) = trans(j);
+    }
+    return pose;
+}
+
+
+bool Tracking::getPose (TrackingPose& pose)
+{
+    pose = latestPose();
+    if (pose.seq == readSeq) return false;
+    readSeq = pose.seq;
+    return true;
+}
+
+void Tracking::setStabilityWindow (int n)
+{
+    statsWindow = max(1, min(n, maxLastPositions));
+}
+
+// stable if no two positions of the window are more than maxDist apart (pairwise diameter from updateStats)
+bool Tracking::hasStablePosition (double maxDist)
+{
+    const PoseStats& s = latestPose().stats;
+    if (s.count < statsWindow) return false; // not enough last positions
+    return s.diameter <= maxDist;
+}
+
+
+    
+// scores thresholds by the number of marker-like regions (dark, convex, four corners) in a greyscale image
+class ThresholdScore : public ParallelLoopBody
+{
+  public:
+    ThresholdScore (const Mat& _img, const vector<int>& _thresholds, double _minArea, vector<int>& _scores)
+    :img(_img),
+     thresholds(_thresholds),
+     minArea(_minArea),
+     scores(_scores)
+    {}
+    
+    void operator() (const Range& range) const
+    {
+        Mat bin;
+        vector<vector<Point> > contours;
+        vector<Point> poly;
+        for (int i=range.start; i<range.end; i++) {
+        
+            // ARToolKit labels pixels below the threshold
+            threshold (img, bin, thresholds[i], 255, THRESH_BINARY_INV);
+            findContours (bin, contours, CV_RETR_LIST, CV_CHAIN_APPROX_SIMPLE);
+            
+            int count = 0;
+            for (uint c=0; c<contours.size(); c++) {
+                if (contourArea(contours[c]) < minArea) continue;
+                approxPolyDP (contours[c], poly, 0.05 * arcLength(contours[c], true), true);
+                if (poly.size() == 4 && isContourConvex(poly)) count++;
+            }
+            scores[i] = count;
+        }
+    }
+    
+  private:
+    const Mat& img;
+    const vector<int>& thresholds;
+    double minArea;
+    vector<int>& scores;
+};
+
+
+// move the threshold to a better candidate nearby: pre-score candidates in parallel on a half size greyscale frame
+// (number of marker-like regions), verify the best ones with ARToolKit (number of markers, error)
+void Tracking::adaptThreshold (bool found)
+{
+    int current = thresh;
+    
+    // candidates around the current threshold
+    vector<int> candidates, effective;
+    for (int k=-autoThresholdCandidates; k<=autoThresholdCandidates; k++) {
+        int t = current + k*autoThresholdStep;
+        if (k == 0 || t < 0 || t > 255) continue;
+        candidates.push_back(t);
+        effective.push_back(effectiveThreshold(t));
+    }
+    
+    // 1) pre-score in parallel
+    Mat grey, small;
+    if (frame.channels() == 1) grey = frame;
+    else cvtColor (frame, grey, CV_BGR2GRAY);
+    resize (grey, small, Size(), 0.5, 0.5, INTER_AREA);
+    
+    vector<int> scores (candidates.size(), 0);
+    parallel_for_ (Range(0, candidates.size()), ThresholdScore(small, effective, 16, scores));
+    
+    // best scores first; on equal score prefer small changes
+    vector<int> order (candidates.size());
+    for (uint i=0; i<order.size(); i++) order[i] = i;
+    for (uint i=0; i<order.size(); i++) {
+        for (uint j=i+1; j<order.size(); j++) {
+            int a = order[i], b = order[j];
+            if (scores[b] > scores[a] || (scores[b] == scores[a] && abs(candidates[b]-current) < abs(candidates[a]-current))) {
+                swap (order[i], order[j]);
+            }
+        }
+    }
+    
+    // 2) verify with ARToolKit; the current threshold has already been evaluated by detect()
+    int bestThresh = current;
+    int bestMarkers = found ? numMarkersUsed : 0;
+    double bestErr = found ? err : -1;
+    for (uint i=0; i<order.size() && i<autoThresholdVerify; i++) {
+        int t = candidates[order[i]];
+        if (scores[order[i]] == 0) break;
+        int numMarkers;
+        double error;
+        if (not evaluateThreshold (t, numMarkers, error)) continue;
+        
+        // more markers are better; same number: smaller error
+        if (numMarkers > bestMarkers || (numMarkers == bestMarkers && (bestErr < 0 || error < bestErr))) {
+            bestThresh = t;
+            bestMarkers = numMarkers;
+            bestErr = error;
+        }
+    }
+    
+    if (bestThresh != current) {
+        thresh = bestThresh;
+        if (debug) cout << "auto threshold: " << current << " -> " << bestThresh << " (" << bestMarkers << " marker, err= " << bestErr << ")" << endl;
+    }
+}
+
+
+// add the current position to the ring buffer; mean and variance are updated with running sums.
+// Bounding radius and diameter need passes over the window: the diameter is the pairwise maximum (O(n^2)),
+// kept on purpose so stabilityTolerance still means the max. distance between two positions;
+// n is bounded by maxLastPositions (at most 190 pairs per detection)
+void Tracking::updateStats()
+{
+    // drop the oldest position if the window is full
+    if (lastPositionsCount == statsWindow) {
+        const Matx31d& old = lastPositions[(lastPositionsHead - statsWindow + 1 + maxLastPositions) % maxLastPositions].camPos;
+        positionSum -= old;
+        positionSqSum -= old.mul(old);
+        lastPositionsCount--;
+    }
+    
+    lastPositionsHead = (lastPositionsHead + 1) % maxLastPositions;
+    lastPositions[lastPositionsHead].time = tcapture;
+    lastPositions[lastPositionsHead].camPos = camPos;
+    positionSum += camPos;
+    positionSqSum += camPos.mul(camPos);
+    lastPositionsCount++;
+    
+    int n = lastPositionsCount;
+    stats.count = n;
+    stats.mean = positionSum * (1.0/n);
+    stats.variance = positionSqSum * (1.0/n) - stats.mean.mul(stats.mean);
+    for (int i=0; i<3; i++) stats.variance(i) = max(stats.variance(i), 0.0); // rounding
+    stats.deviation = sqrt(stats.variance(0) + stats.variance(1) + stats.variance(2));
+    
+    // bounding radius and pairwise maximum (at most maxLastPositions points)
+    stats.radius = 0;
+    stats.diameter = 0;
+    for (int k=0; k<n; k++) {
+        const PositionSample& p = lastPositions[(lastPositionsHead - k + maxLastPositions) % maxLastPositions];
+        stats.radius = max(stats.radius, norm(p.camPos - stats.mean));
+        for (int j=k+1; j<n; j++) {
+            const PositionSample& q = lastPositions[(lastPositionsHead - j + maxLastPositions) % maxLastPositions];
+            stats.diameter = max(stats.diameter, norm(p.camPos - q.camPos));
+        }
+    }
+    stats.span = elapsed_ms(lastPositions[(lastPositionsHead - n + 1 + maxLastPositions) % maxLastPositions].time, tcapture);
+    
+    stats.speed = norm(velocity) * 1000.0;
+    stats.angularSpeed = norm(angularVelocity) * 1000.0 / M_PI * 180.0;
+}
+
+
+// add the current pose to the history and estimate the velocities:
+// least squares line fit for the position, mean rotation rate between oldest and newest pose
+void Tracking::updateMotion()
+{
+    PoseSample sample;
+    sample.time = tcapture;
+    sample.camPos = camPos;
+    sample.rotMat = rotMat;
+    poseHistory.push_front(sample);
+    
+    // only recent poses follow the constant velocity assumption
+    while (poseHistory.size() > poseHistorySize || 
+           (poseHistory.size() > 1 && elapsed_ms(poseHistory.back().time, tcapture) > poseHistoryWindow)) {
+        poseHistory.pop_back();
+    }
+    
+    velocity = angularVelocity = Matx31d(0,0,0);
+    int n = poseHistory.size();
+    if (n < 2) return;
+    
+    // times relative to the newest pose
+    vector<double> t(n);
+    double tMean = 0;
+    Matx31d pMean (0,0,0);
+    for (int i=0; i<n; i++) {
+        t[i] = elapsed_ms(tcapture, poseHistory[i].time);
+        tMean += t[i] / n;
+        pMean += poseHistory[i].camPos * (1.0/n);
+    }
+    double stt = 0;
+    Matx31d stp (0,0,0);
     for (int i=0; i<n; i++) {
-        for (int j=0; j<n; j++) {
-            if (i == j) continue;
-            double dist = norm(lastPositions[i], lastPositions[j], NORM_L2);
-            if (dist > maxDist) return false;
+        stt += (t[i]-tMean) * (t[i]-tMean);
+        stp += (poseHistory[i].camPos - pMean) * (t[i]-tMean);
+    }
+    if (stt <= 0) return;
+    velocity = stp * (1.0/stt);
+    
+    // rotation from oldest to newest pose
+    Matx33d dR = poseHistory.front().rotMat * poseHistory.back().rotMat.t();
+    Matx31d rvec;
+    Rodrigues (dR, rvec);
+    angularVelocity = rvec * (1.0 / -t[n-1]);
+}
 
+
+// bounding box of the marker panel projected with the last position, padded for movement;
+// empty if the panel covers most of the frame anyway
+Rect Tracking::getMarkerROI()
+{
+    Point pmin (frame.cols, frame.rows);
+    Point pmax (0, 0);
+    for (int m=0; m<config->marker_num; m++) {
+        for (int i=0; i<4; i++) {
+            double* p3d = config->marker[m].pos3d[i];
+            Point p = space2screen(cameraMatrix, transMat, Matx31d(p3d[0], p3d[1], p3d[2]));
+            pmin.x = min(pmin.x, p.x);
+            pmin.y = min(pmin.y, p.y);
+            pmax.x = max(pmax.x, p.x);
+            pmax.y = max(pmax.y, p.y);
         }
     }
+    int padX = (pmax.x - pmin.x) * roiPadding;
+    int padY = (pmax.y - pmin.y) * roiPadding;
     
-    return true;
+    // multiples of 4 (ARToolKit may process the image in half resolution)
+    int x0 = max(pmin.x - padX, 0) / 4 * 4;
+    int y0 = max(pmin.y - padY, 0) / 4 * 4;
+    int x1 = min(pmax.x + padX, frame.cols) / 4 * 4;
+    int y1 = min(pmax.y + padY, frame.rows) / 4 * 4;
+    if (x1 <= x0 || y1 <= y0) return Rect();
+    
+    Rect roi (x0, y0, x1-x0, y1-y0);
+    if (roi.area() > 0.5 * frame.total()) return Rect();
+    return roi;
 }
 
 
+// run ARToolKit marker detection on the region of interest only; 
+// markers are shifted back to frame coordinates
+int Tracking::detectMarkerROI (Rect roi, int threshold)
+{
+    frame(roi).copyTo(roiFrame);
+    
+    // ARToolKit takes the image size from the globals set by arInitCparam
+    int xsize = arImXsize;
+    int ysize = arImYsize;
+    arImXsize = roi.width;
+    arImYsize = roi.height;
+    int ret = arDetectMarker((ARUint8 *)roiFrame.data, threshold, &markerInfo, &markerNum);
+    arImXsize = xsize;
+    arImYsize = ysize;
+    if (ret < 0) return ret;
+    
+    for (int k=0; k<markerNum; k++) {
+        ARMarkerInfo& m = markerInfo[k];
+        for (int i=0; i<4; i++) {
+            m.vertex[i][0] += roi.x;
+            m.vertex[i][1] += roi.y;
+            m.line[i][2] -= m.line[i][0] * roi.x + m.line[i][1] * roi.y;
+        }
+        m.pos[0] += roi.x;
+        m.pos[1] += roi.y;
+    }
+    return ret;
+}
+
+
+// undistort vertices and center of all detected markers (detection ran on the distorted frame)
+// and recalculate the edge lines, which are used by ARToolKit for the initial rotation estimate
+void Tracking::undistortMarkers()
+{
+    if (markerNum <= 0) return;
+    
+    vector<Point2f> points (markerNum * 5);
+    for (int k=0; k<markerNum; k++) {
+        for (int i=0; i<4; i++) {
+            points[5*k+i] = Point2f (markerInfo[k].vertex[i][0], markerInfo[k].vertex[i][1]);
+        }
+        points[5*k+4] = Point2f (markerInfo[k].pos[0], markerInfo[k].pos[1]);
+    }
+    
+    // P = cameraMatrix: result in pixel coordinates of the ideal camera, same as the remapped frame
+    vector<Point2f> undistorted;
+    undistortPoints (points, undistorted, cameraMatrix, distCoeffs, Mat(), cameraMatrix);
+    
+    for (int k=0; k<markerNum; k++) {
+        ARMarkerInfo& m = markerInfo[k];
+        for (int i=0; i<4; i++) {
+            m.vertex[i][0] = undistorted[5*k+i].x;
+            m.vertex[i][1] = undistorted[5*k+i].y;
+        }
+        m.pos[0] = undistorted[5*k+4].x;
+        m.pos[1] = undistorted[5*k+4].y;
+        
+        // line i runs from vertex i to vertex i+1; normalized a*x + b*y + c = 0
+        for (int i=0; i<4; i++) {
+            Point2f p0 = undistorted[5*k+i];
+            Point2f p1 = undistorted[5*k+(i+1)%4];
+            double dx = p1.x - p0.x;
+            double dy = p1.y - p0.y;
+            double len = sqrt(dx*dx + dy*dy);
+            if (len == 0) continue;
+            m.line[i][0] = dy / len;
+            m.line[i][1] = -dx / len;
+            m.line[i][2] = -(m.line[i][0] * p0.x + m.line[i][1] * p0.y);
+        }
+    }
+}
+
     
 // main marker detection
 bool Tracking::detect()
@@ -272,13 +838,28 @@ bool Tracking::detect()
     clock(tstart);
     markerInfo = NULL;
     markerNum = -1;
-    if ( arDetectMarker((ARUint8 *)frame.data, (useInverted?(255-thresh):thresh), &markerInfo, &markerNum) < 0 ) {
+    
+    // search around the last position, if there was one in the last frame
+    Rect roi;
+    if (useROI && markerDetected && roiFrameCount < roiFullSearchInterval) {
+        roi = getMarkerROI();
+    }
+    int ret;
+    if (roi.area() > 0) {
+        roiFrameCount++;
+        ret = detectMarkerROI(roi, effectiveThreshold(thresh));
+    } else {
+        roiFrameCount = 0;
+        ret = arDetectMarker((ARUint8 *)frame.data, effectiveThreshold(thresh), &markerInfo, &markerNum);
+    }
+    if ( ret < 0 ) {
         cout << "Error while detecting marker" << endl;
         markerDetected = false;
         return false;
     }
+    if (useUndistortPoints) undistortMarkers();
     if (debug)  clock(tend);
-    if (debug) cout << "marker detection took " << elapsed_ms (tstart, tend)  << " ms" << endl;
+    if (debug) cout << "marker detection " << (roi.area() > 0 ? "(roi) " : "") << "took " << elapsed_ms (tstart, tend)  << " ms" << endl;
 
 
     // count number of visible markers
@@ -297,12 +878,6 @@ bool Tracking::detect()
     err = arMultiGetTransMat(markerInfo, markerNum, config);
     err /= (float)numMarkersUsed;
 
-    // auto threshold: find threshold that produces the smallest error
-    if (err < 0 && useAutoThreshold) {    
-        runAutoThreshold();
-    }
-     
-    
     if (err < 0 ) {
         markerDetected = false;
         return false;
@@ -332,10 +907,6 @@ bool Tracking::detect()
         // get camera position (translation vector)
         camPos = -rotMat * Matx31d(transMat(0,3), transMat(1,3), transMat(2,3));
         
-        
-        // inefficient, but quickly implemented:
-        lastPositions.insert(lastPositions.begin(), camPos);
-        lastPositions.resize(maxLastPositions);
     }
     
     if (debug) clock(tend);
@@ -347,40 +918,78 @@ bool Tracking::detect()
     return true;
 }
 
-// draw the debug image
-void Tracking::createDebugImage()
+// copy the detection results into the debug data; the frame itself is shared (see releaseFrames())
+void Tracking::collectDebugData (TrackingDebugData& data)
 {
-
-    // POSSIBLE SPEEDUP
-    frame.copyTo(debugFrame);
-
-     for( int k=0; k<markerNum; k++ ) {
+    data.frame = frame;
+    data.map1 = useUndistortPoints ? map1 : Mat();
+    data.map2 = useUndistortPoints ? map2 : Mat();
+    data.cameraMatrix = cameraMatrix;
+    data.threshold = effectiveThreshold(thresh);
+    
+    data.markers.clear();
+    for( int k=0; k<markerNum; k++ ) {
         for (int m=0; m<config->marker_num; m++ ) {
             if ( (config->marker[m].patt_id == markerInfo[k].id) && (config->marker[m].visible != -1) ) { 
-                Point2i corners[4];
-                for (int i=0; i<4; i++)
-                corners[i] = Point2i (markerInfo[k].vertex[i][0], markerInfo[k].vertex[i][1]);
-
-                // draw border
+                TrackingMarker marker;
+                marker.id = config->marker[m].patt_id;
+                marker.cf = markerInfo[k].cf;
                 for (int i=0; i<4; i++) {
-                    line(debugFrame, corners[i], corners [(i+1)%4],CV_RGB(255,0,0),1);
+                    marker.vertex[i] = Point2d (markerInfo[k].vertex[i][0], markerInfo[k].vertex[i][1]);
                 }
-
-                // print ID
-                stringstream ss;    
-                ss << config->marker[m].patt_id << " (" << markerInfo[k].cf << ") ";
-                putText(debugFrame, ss.str().c_str(),  Point(markerInfo[k].pos[0], markerInfo[k].pos[1]), FONT_HERSHEY_PLAIN, 1, CV_RGB(0,255,0), 1.5);
+                marker.pos = Point2d (markerInfo[k].pos[0], markerInfo[k].pos[1]);
+                data.markers.push_back(marker);
             }
         }
     }
+}
 
+// a published pose references the current frame: drop all buffers the frame may alias,
+// so the next frames are written into new memory
+void Tracking::releaseFrames()
+{
+    frame = Mat();
+    grey = Mat();
+    rawGrey = Mat();
+    rawFrame = Mat();
+    if (level > 0) pyramid[level] = Mat();
+}
 
-    // revert previous invertion for correct display
-//    if (useInverted) {
-//        debugFrame = Mat(debugFrame.size(), CV_8UC3, CV_RGB(255,255,255)) - debugFrame;
-//    }
+// draw the debug image of a pose (on the caller's thread)
+Mat Tracking::renderDebugImage (const TrackingPose& pose)
+{
+    const TrackingDebugData& data = pose.debug;
+    if (data.frame.empty()) return Mat();
+
+    // detection ran on the distorted frame, but the marker vertices are undistorted: undistort the image as well
+    Mat img = data.frame;
+    if (not data.map1.empty()) {
+        img = Mat();
+        remap(data.frame, img, data.map1, data.map2, INTER_LINEAR);
+    }
     
-    threshold(debugFrame, debugFrame, (useInverted?(255-thresh):thresh), 255, THRESH_BINARY);
+    Mat debugFrame;
+    if (img.channels() == 1) {
+        cvtColor(img, debugFrame, CV_GRAY2BGR);
+    } else {
+        img.copyTo(debugFrame);
+    }
+
+    for (uint k=0; k<data.markers.size(); k++) {
+        const TrackingMarker& marker = data.markers[k];
+        
+        // draw border
+        for (int i=0; i<4; i++) {
+            line(debugFrame, marker.vertex[i], marker.vertex[(i+1)%4],CV_RGB(255,0,0),1);
+        }
+
+        // print ID
+        stringstream ss;    
+        ss << marker.id << " (" << marker.cf << ") ";
+        putText(debugFrame, ss.str().c_str(), marker.pos, FONT_HERSHEY_PLAIN, 1, CV_RGB(0,255,0), 1.5);
+    }
+
+    threshold(debugFrame, debugFrame, data.threshold, 255, THRESH_BINARY);
 
     // draw unit vectors at origin of world
     double len = 30; // in mm
@@ -390,29 +999,11 @@ void Tracking::createDebugImage()
     Vec3d yaxis (0,len,0);
     Vec3d zaxis (0,0,len);
 
-    line(debugFrame, space2screen(cameraMatrix, transMat, O), space2screen(cameraMatrix, transMat, xaxis), CV_RGB(0,0,255),3);
-    line(debugFrame, space2screen(cameraMatrix, transMat, O), space2screen(cameraMatrix, transMat, yaxis), CV_RGB(255,0,0),3);
-    line(debugFrame, space2screen(cameraMatrix, transMat, O), space2screen(cameraMatrix, transMat, zaxis), CV_RGB(0,255,0),3);
- 
-    /*
-    // print position, rotation, error, number of markers
-    stringstream ss;
-    ss << "pos_cart = " << camPos;
-    putText(debugFrame, ss.str().c_str(), Point(20,440), FONT_HERSHEY_PLAIN, 1, CV_RGB(255,255,255), 1);
-
-    ss.str(string());
-    ss << "pos_sphere = " << cart2spher(camPos);
-    putText(debugFrame, ss.str().c_str(), Point(20,460), FONT_HERSHEY_PLAIN, 1, CV_RGB(255,255,255), 1);
-
-    ss.str(string());
-    ss << "err = " << err;
-    putText(debugFrame, ss.str().c_str(), Point(20,420), FONT_HERSHEY_PLAIN, 1, CV_RGB(255,255,255), 1);
-
-    // print threshold 
-    ss.str(string());
-    ss << thresh;
-    putText(debugFrame, ss.str().c_str(), Point(20,20), FONT_HERSHEY_PLAIN, 1, CV_RGB(255,255,255), 1);
-    */
+    line(debugFrame, space2screen(data.cameraMatrix, pose.transMat, O), space2screen(data.cameraMatrix, pose.transMat, xaxis), CV_RGB(0,0,255),3);
+    line(debugFrame, space2screen(data.cameraMatrix, pose.transMat, O), space2screen(data.cameraMatrix, pose.transMat, yaxis), CV_RGB(255,0,0),3);
+    line(debugFrame, space2screen(data.cameraMatrix, pose.transMat, O), space2screen(data.cameraMatrix, pose.transMat, zaxis), CV_RGB(0,255,0),3);
+    
+    return debugFrame;
 }
 
         
@@ -7,6 +7,7 @@
 #include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
 #include <opencv2/imgproc/imgproc.hpp>  // Image Processing
 #include <opencv2/highgui/highgui.hpp>  // OpenCV window and video I/O
+#include <opencv2/calib3d/calib3d.hpp>  // Rodrigues
 
 // ARToolKit
 #include <AR/gsub.h>
@@ -20,22 +21,89 @@
 #include <time.h>
 #include <stdio.h>
 #include <string.h>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 #include "util.h"
+#include "framesource.h"
 
 using namespace std;
 using namespace cv;
 
+
+// statistics of the last camera positions (stability window), updated with every detection
+struct PoseStats {
+    PoseStats () : count(0), span(0), radius(0), diameter(0), deviation(0), speed(0), angularSpeed(0) {}
+    
+    int count;              // number of positions in the window
+    double span;            // time between oldest and newest position in ms
+    Matx31d mean;           // mean camera position
+    Matx31d variance;       // variance of the camera position per axis
+    double radius;          // bounding radius: max. distance of a position from the mean
+    double diameter;        // max. distance between two positions
+    double deviation;       // standard deviation of the position (jitter), sqrt of the summed variances
+    double speed;           // linear camera velocity in mm/s (motion model)
+    double angularSpeed;    // angular camera velocity in degree/s (motion model)
+};
+
+
+// marker found by ARToolKit and used for the position
+struct TrackingMarker {
+    int id;                 // pattern id
+    double cf;              // confidence
+    Point2d vertex[4];      // corners in frame coordinates
+    Point2d pos;            // center
+};
+
+
+// everything the tracking debug image is rendered from (only if debug is enabled)
+struct TrackingDebugData {
+    Mat frame;              // detection input (ARToolKit pixel format, inverted if enabled); shared, not copied
+    Mat map1, map2;         // undistort maps if only the marker vertices were undistorted, empty otherwise
+    Mat cameraMatrix;       // intrinsics of the frame (tracking resolution)
+    int threshold;          // threshold applied to the frame
+    vector<TrackingMarker> markers;
+};
+
+
+// one tracking result; published as a whole by the tracking thread
+struct TrackingPose {
+    TrackingPose () : err(-1), numMarkers(0), seq(0), frameIndex(0), droppedFrames(0) { time.tv_sec = time.tv_nsec = 0; captureTime = readTime = time; }
+    
+    Matx44d transMat;       // transformation matrix from world coordinates -> camera coordinates
+    Matx33d rotMat;         // camera rotation
+    Matx31d camPos;         // camera position
+    double err;             // position error (from artoolkit, normalized with number of visible pattern)
+    int numMarkers;         // number of markers used for the position
+    unsigned long seq;      // sequence number; incremented for every published pose, 0 if there is none yet
+    unsigned long frameIndex;    // index of the frame in the frame source
+    unsigned long droppedFrames; // camera frames the detection has skipped so far
+    timespec captureTime;   // time the camera frame was grabbed
+    timespec readTime;      // time the frame source delivered the frame (detection latency = time - readTime)
+    timespec time;          // time the pose was calculated
+    
+    // constant velocity motion model, estimated from the recent poses
+    Matx31d velocity;       // camera position change in mm per ms
+    Matx31d angularVelocity;// camera rotation (rotation vector in world coordinates) in rad per ms
+    PoseStats stats;        // statistics of the last positions
+    TrackingDebugData debug;// data for the debug image (only if debug is enabled), see Tracking::renderDebugImage
+};
+
+
 class Tracking
 {
   
   public: 
-    Tracking (VideoCapture& camCapture, 
+    Tracking (FrameSource& frameSource, 
               string camParamsFile, 
               string markerConfigFile,
               int threshold = 50, 
               bool greyscale = false,
-              bool inverted = false);
+              bool inverted = false,
+              bool undistortPoints = false,
+              Size resolution = Size());   // requested camera resolution; empty: camera default
     ~Tracking ();
     
     // treshold can be changed at runtime
@@ -43,65 +111,146 @@ class Tracking
     int getThreshold () { return thresh; }
     bool runAutoThreshold();
     
+    // adapt the threshold while tracking: after a miss and every interval frames
+    void setAutoThreshold (bool enable, int interval) { useAutoThreshold = enable; autoThresholdInterval = interval; }
+    
+    // false if the constructor failed (no frame from the source, marker config not readable); do not start then
+    bool isOpened() { return opened; }
+    
     // start/stop tracking thread
     void start();
     void stop();
+    bool finished() { return trackingEnded; } // tracking thread has ended (stopped or end of a replay)
     double lastTime (); // time in ms since last valid tracking position
-    void lockThread() { readerLock = true; }
-    void unlockThread(){ readerLock = false; }
     
-    // if new position is available; resets hasNew to false
-    bool hasNewData();
+    // snapshot of the latest position; returns true if it was not returned before.
+    // Never blocks; must only be called from one (reader) thread, same for lastTime().
+    bool getPose (TrackingPose& pose);
+    
+    // latest pose extrapolated to time t (e.g. when the next frame will be shown) with the motion model;
+    // does not change what getPose() considers new. Same single reader thread as getPose().
+    TrackingPose predictPose (timespec t);
     
     // if last frame had visible marker
     bool hasVisibleMarker() { return markerDetected; }
     
-    // if position was stable in the last n detections
-    bool hasStablePosition (int n, double maxDist);
-    
-    int getNumMarker() { return numMarkersUsed; }
+    // if the positions in the stability window are within maxDist of each other (diameter <= maxDist);
+    // false until the window is filled. Same single reader thread as getPose().
+    bool hasStablePosition (double maxDist);
     
-    // position error (from artoolkit, normalized with number of visible pattern)
-    double getError() { return err; }
+    // number of detections in the stability window (at most maxLastPositions); set before start()
+    void setStabilityWindow (int n);
     
+    // search markers only around the marker panel of the last position; full frame search after a miss
+    // or after fullSearchInterval frames
+    void setROISearch (bool enable, int fullSearchInterval) { useROI = enable; roiFullSearchInterval = fullSearchInterval; }
     
+    // pyramid mode: detect on a level downscaled l times (0: off), except in full resolution mode.
+    // Set before start(); the level switch happens on the next frame.
+    void setPyramidLevel (int l);
+    void setFullResolution (bool val) { fullResolution = val; }
     
-    // get latest position information
-    Matx44d getTransform() { return transMat; }
-    Matx33d getRotation() { return rotMat; }
-    Matx31d getPosition() { return camPos; }
-    
-    // debug image for display
+    // debug data for display; the image is rendered by the caller with renderDebugImage()
     void setDebug( bool val ) { debug = val; }
-    Mat& getDebugImage() { return debugFrame; }
+    static Mat renderDebugImage (const TrackingPose& pose);
     
     
   private: 
     
     // camera stuff
-    VideoCapture& capt;
-    Mat frame;
+    FrameSource& source;
+    bool opened;
+    Mat rawFrame;       // captured frame
+    Mat rawGrey, grey;  // luminance plane before / after undistortion (greyscale mode)
+    Mat frame;          // input for ARToolKit (undistorted, inverted, in the ARToolKit pixel format)
     Mat cameraMatrix;
     Mat distCoeffs;
     Mat map1, map2;
     ARParam cameraParam;
     
+    // tracking resolution: level 0 is the camera frame, every level halves the size (pyrDown).
+    // cameraMatrix, map1, map2 and cameraParam above are the ones of the current level.
+    struct Level {
+        Size size;
+        Mat cameraMatrix;   // intrinsics scaled to the level
+        Mat map1, map2;     // undistort maps
+        ARParam param;
+    };
+    vector<Level> levels;
+    vector<Mat> pyramid;            // downscaled frames per level
+    int idleLevel;                  // level used while not in full resolution mode
+    int level;                      // level of the current frame (tracking thread)
+    atomic<bool> fullResolution;    // requested by the reader: detect on level 0
+    void initLevel (int l);
+    void useLevel (int l);
+    Mat downscale (const Mat& img);
+    
     
-    // thread stuff
-    bool grab();
+    // thread stuff: the grab thread captures frames, the tracking thread detects markers on the latest one
+    bool grab();        // grab thread: capture a frame and put it into the frame slot; false at the end of a replay
+    void preprocess();  // tracking thread: undistortion, greyscale and inversion of rawFrame
+    static void* grabLoop(void *ptr);
     static void* trackingLoop(void *ptr);
-    bool running;
-    bool lock;          // write-lock if a detection is currently in progress (shared ressources are written)
-    bool readerLock;    // read-lock if a shared ressources are accessed from outside
-    timespec tlast;     // last time a position was calculated  
+    atomic<bool> running;
+    atomic<bool> trackingEnded;
+    pthread_t grabThread, trackingThread;
+    
+    // frame handoff (one slot, latest frame wins; lossless replay: the grab thread waits until the slot was taken)
+    mutex slotMutex;
+    condition_variable slotCond;
+    Mat grabFrame;      // frame being captured (grab thread)
+    Mat slotFrame;      // latest captured frame that was not taken yet
+    timespec slotTime;  // capture time of slotFrame
+    timespec slotReadTime;      // time slotFrame was read from the source
+    unsigned long slotIndex;    // frame index of slotFrame
+    bool slotFull;
+    bool grabEnded;     // no more frames (end of the replay)
+    atomic<unsigned long> droppedFrames; // frames replaced in the slot before the tracking thread took them
+    bool takeFrame();   // tracking thread: wait for the next frame and move it to rawFrame; false if stopped
     
+    // pose handoff (triple buffer): the tracking thread fills the back slot and swaps it with the middle one,
+    // the reader swaps the middle slot with its front slot if it holds a newer pose. Nobody waits.
+    #define POSE_NEW 4  // flag in poseMiddle: middle slot has not been read yet
+    TrackingPose poseSlots[3];
+    int poseBack;               // slot written by the tracking thread
+    int poseFront;              // slot owned by the reader
+    atomic<int> poseMiddle;     // slot index | POSE_NEW
+    unsigned long poseSeq;      // sequence number of the last published pose (tracking thread)
+    unsigned long readSeq;      // sequence number of the last pose returned by getPose (reader)
+    void publishPose();         // publish the current tracking information
+    const TrackingPose& latestPose(); // reader: front slot, updated to the newest published pose
     
     
+    
+    // lens distortion: undistort the whole frame (default) or only the detected marker vertices
+    bool useUndistortPoints;
+    void undistortMarkers();
+    
+    // region of interest search
+    bool useROI;
+    int roiFullSearchInterval;  // frames between two full frame searches
+    int roiFrameCount;          // frames since the last full frame search
+    Mat roiFrame;               // contiguous copy of the region of interest
+    #define roiPadding 0.25     // padding around the projected marker panel (relative to its size)
+    Rect getMarkerROI();        // projected and padded marker panel of the last position
+    int detectMarkerROI (Rect roi, int threshold); // arDetectMarker inside roi; results in frame coordinates
+    
     // thresholding
     bool useInverted;
     bool useGreyscale;
-    const bool useAutoThreshold = false;
-    int thresh;
+    atomic<int> thresh;
+    int effectiveThreshold (int t) { return useInverted ? (255-t) : t; } // threshold on the (inverted) frame
+    bool evaluateThreshold (int t, int& numMarkers, double& error); // full ARToolKit detection and position with threshold t
+    
+    // adaptive threshold: candidates around thresh are pre-scored in parallel on a downscaled frame,
+    // the most promising ones are verified with ARToolKit
+    bool useAutoThreshold;
+    int autoThresholdInterval;  // frames between two adaptions if the markers are found
+    int autoThresholdCount;     // frames since the last adaption
+    #define autoThresholdStep 8         // distance of the candidate thresholds
+    #define autoThresholdCandidates 3   // candidates on each side of the current threshold
+    #define autoThresholdVerify 2       // number of candidates verified with ARToolKit
+    void adaptThreshold (bool found);
     
     // marker config and detection
     ARMultiMarkerInfoT  *config;
@@ -110,23 +259,49 @@ class Tracking
     int numMarkersUsed; // actually used number of marker
 
     bool detect();      // run marker detection and pos calculation
-    bool markerDetected; // if last frame had visible markers
+    atomic<bool> markerDetected; // if last frame had visible markers
     
-    // tracking information
+    // tracking information (tracking thread only; published with publishPose)
     Matx44d transMat; // transformation matrix from world coordinates -> camera coordinates
     Matx33d rotMat; 
     Matx31d camPos;
     double err;
-    bool hasNew;    // if new data is available
+    timespec tlast;     // last time a position was calculated  
+    timespec tcapture;  // time the current frame was grabbed
+    timespec tread;     // time the current frame was read from the source
+    unsigned long frameIndex;   // index of the current frame
     
-    #define maxLastPositions 20
+    // pose history for the motion model (tracking thread only)
+    #define poseHistorySize 6       // max. number of poses used for the velocity estimate
+    #define poseHistoryWindow 250   // max. age of the poses used for the velocity estimate in ms
+    #define maxPredictionMs 100     // never extrapolate further than this
+    struct PoseSample {
+        timespec time;      // capture time
+        Matx31d camPos;
+        Matx33d rotMat;
+    };
+    deque<PoseSample> poseHistory;
+    Matx31d velocity, angularVelocity;
+    void updateMotion();    // add the current pose to the history and update the velocity estimate
     
-    vector<Matx31d> lastPositions;
+    // ring buffer of the last positions with running sums for the statistics (tracking thread only)
+    #define maxLastPositions 20
+    struct PositionSample {
+        timespec time;      // capture time
+        Matx31d camPos;
+    };
+    PositionSample lastPositions[maxLastPositions];
+    int lastPositionsHead;      // index of the newest position
+    int lastPositionsCount;     // number of positions in the window
+    int statsWindow;            // window size
+    Matx31d positionSum, positionSqSum; // sum of the positions and squared positions in the window
+    PoseStats stats;
+    void updateStats();     // add the current position to the window and update the statistics
 
     // debug stuff
     bool debug;
-    Mat debugFrame;
-    void createDebugImage();
+    void collectDebugData (TrackingDebugData& data); // frame and detected markers of the current pose
+    void releaseFrames();   // the published frame is shared: continue with new frame buffers
     
     
 
@@ -202,6 +202,65 @@ float interpolate_linear (float p, float p1, float p2, float val1, float val2)
 // (response) curve stuff
 //
 
+/**
+ load SVR data for a display configuration: from the binary SVR file given by the key svrFile (memory-mapped),
+ or from the min_N / max_N / response_N keys of the configuration itself
+*/
+bool load_svr (FileStorage& fs, SVRInfo& svr)
+{
+    SVRFileHeader header;
+    
+    string svrFile; fs["svrFile"] >> svrFile;
+    if (svrFile.empty()) {
+        vector<Vec3f> vMin, vMax;
+        vector<vector<Vec3f> > response;
+        if (not read_svr_yaml (fs, header, vMin, vMax, response)) return false;
+        
+        // interleaved BGR curves -> [channel][patch][lutIndex]
+        svr.allocate (header.numPatches, header.lutSize);
+        for (int n=0; n<svr.size; n++) {
+            if ((int)response[n].size() != svr.lutSize) {
+                cout << "Error: response curve " << n << " has " << response[n].size() << " instead of " << svr.lutSize << " entries" << endl;
+                return false;
+            }
+            for (int c=0; c<3; c++) {
+                svr.vMin.ptr<float>(c)[n] = vMin[n][c];
+                svr.vMax.ptr<float>(c)[n] = vMax[n][c];
+                float* curve = svr.response.ptr<float>(c*svr.size + n);
+                for (int i=0; i<svr.lutSize; i++) {
+                    curve[i] = response[n][i][c];
+                }
+            }
+        }
+    } else {
+        // the arrays already have the right layout; use the mapping directly (read-only)
+        Ptr<SVRFile> file (new SVRFile);
+        if (not file->open (svrFile)) return false;
+        header = *file->header;
+        
+        svr.size = header.numPatches;
+        svr.lutSize = header.lutSize;
+        svr.vMin = Mat (3, svr.size, CV_32F, (void*) file->vMin(0));
+        svr.vMax = Mat (3, svr.size, CV_32F, (void*) file->vMax(0));
+        svr.response = Mat (3*svr.size, svr.lutSize, CV_32F, (void*) file->response(0, 0));
+        svr.file = file;
+    }
+    svr.updateRanges();
+    
+    svr.borderSize = Size2d (header.borderSize[0], header.borderSize[1]);
+    svr.screenSize = Size2d (header.screenSize[0], header.screenSize[1]);
+    svr.patchLayout = Size (header.patchLayout[0], header.patchLayout[1]);
+    svr.patchSize = header.patchSize;
+    svr.exposure = header.exposure;
+    if (header.hasColorTransform) {
+        svr.colorTransMat = Mat (3, 3, CV_64F, header.colorTransform).clone();
+    }
+    
+    // check if patch layout and definitions are consistent
+    return svr.checkValues();
+}
+
+
 /**
  linear scale value val, so that minVal is mapped to 0.0 and maxVal is mapped to 1.0
 */
@@ -216,9 +275,11 @@ float fit_in_range (float val, float minVal, float maxVal)
 */
 vector<Vec3f>& fit_in_range ( vector<Vec3f>& curve, Vec3f minVal, Vec3f maxVal)
 {
-    for (uint8_t c=0; c<3; c++)
+    for (uint8_t c=0; c<3; c++) {
+        float invRange = 1.0 / (maxVal[c] - minVal[c]);
         for (uint16_t i=0; i<curve.size(); i++)
-            curve[i][c] = fit_in_range (curve[i][c], minVal[c], maxVal[c]);
+            curve[i][c] = (curve[i][c] - minVal[c]) * invRange;
+    }
             
     return curve;
 }
@@ -230,9 +291,10 @@ vector<Vec3f>& fit_in_range ( vector<Vec3f>& curve, Vec3f minVal, Vec3f maxVal)
 Vec3f lookup_response (Vec3f val, SVRInfo& svr, int idx)
 {
     Vec3f res;
-    res[0] = svr.response[idx][(int)(fit_in_range(val[0],svr.vMin[idx][0],svr.vMax[idx][0]) * (svr.response[idx].size()-1) + 0.5)][0];
-    res[1] = svr.response[idx][(int)(fit_in_range(val[1],svr.vMin[idx][1],svr.vMax[idx][1]) * (svr.response[idx].size()-1) + 0.5)][1];
-    res[2] = svr.response[idx][(int)(fit_in_range(val[2],svr.vMin[idx][2],svr.vMax[idx][2]) * (svr.response[idx].size()-1) + 0.5)][2];
+    for (int c=0; c<3; c++) {
+        float pos = (val[c] - svr.minValues(c)[idx]) * svr.invRanges(c)[idx];
+        res[c] = svr.curve(c, idx)[(int)(pos * (svr.lutSize-1) + 0.5)];
+    }
     return res;
 }
 
@@ -244,10 +306,12 @@ Vec3f lookup_response (Vec3f val, SVRInfo& svr, int idx)
 */
 float lookup_response_subpixel (float& val, SVRInfo& svr, int idx, int channel)
 {
-    if (val < svr.vMin[idx][channel]) return 0; // minimum light output reached
-    if (val > svr.vMax[idx][channel]) return 1; // maximum light output reached
+    float vMin = svr.minValues(channel)[idx];
+    if (val < vMin) return 0;                                   // minimum light output reached
+    if (val > svr.maxValues(channel)[idx]) return 1;            // maximum light output reached
     
-    float res = svr.response[idx][(int)(fit_in_range(val,svr.vMin[idx][channel],svr.vMax[idx][channel]) * (svr.response[idx].size()-1) + 0.5)][channel];
+    float pos = (val - vMin) * svr.invRanges(channel)[idx];     // fit_in_range with the precomputed 1/(vMax-vMin)
+    float res = svr.curve(channel, idx)[(int)(pos * (svr.lutSize-1) + 0.5f)];
    
     return res;
 }
@@ -380,6 +444,7 @@ float get_min_max_subpixel( SVRInfo& svr, Point2d pos, int channel, bool useMin
     double w = svr.screenSize.width - 2*svr.borderSize.width;
     double h = svr.screenSize.height - 2*svr.borderSize.height;
     int c  = channel;
+    const float* values = useMin ? svr.minValues(c) : svr.maxValues(c);   // per patch values of the channel
     
     // number of patches in each direction
     int numx = svr.patchLayout.width;
@@ -403,21 +468,21 @@ float get_min_max_subpixel( SVRInfo& svr, Point2d pos, int channel, bool useMin
     // check if and how we have to interpolate (4 cases)
     // 0) no interpolation (corners)
     if ( !(  ix >= svr.patchSize/2.0 && ix <= w-1 - svr.patchSize/2 ) && !(iy >= svr.patchSize/2 && iy <= h-1 - svr.patchSize/2 ) ) {                    
-        res = (useMin ? svr.vMin : svr.vMax)[y*numx + x][c];
+        res = values[y*numx + x];
     
     // 1) only vertical interpolation (vertical edges)
     } else if ( (ix < svr.patchSize/2 || ix > w-1 - svr.patchSize/2) && iy >= svr.patchSize/2 && iy <= h-1 - svr.patchSize/2 ) {
         int a = (py < svr.patchSize / 2) ? y-1 : y;  // above neighbor y position
-        float val0 = (useMin ? svr.vMin : svr.vMax)[a*numx + x][c];       // above
-        float val1 = (useMin ? svr.vMin : svr.vMax)[(a+1)*numx + x][c];   // below
+        float val0 = values[a*numx + x];       // above
+        float val1 = values[(a+1)*numx + x];   // below
         res = interpolate_linear(iy, (double)a*svr.patchSize + svr.patchSize/2.0, 
                                     ((double)a+1.0)*svr.patchSize + svr.patchSize/2.0, val0, val1);
     
     // 2) only horizontal interpolation required (horizontal edges)
     } else if ( (iy < svr.patchSize/2 || iy > h-1 - svr.patchSize/2) && ix >= svr.patchSize/2 && ix <= w-1 - svr.patchSize/2 ) {
         int l = (px < svr.patchSize / 2) ? x-1 : x;  // left neighbor x position
-        float val0 = (useMin ? svr.vMin : svr.vMax)[y*numx + l][c];     // left
-        float val1 = (useMin ? svr.vMin : svr.vMax)[y*numx + l+1][c];   // right
+        float val0 = values[y*numx + l];     // left
+        float val1 = values[y*numx + l+1];   // right
         res = interpolate_linear(ix, (double)l*svr.patchSize + svr.patchSize/2.0, 
                                     ((double)l+1.0)*svr.patchSize + svr.patchSize/2.0, val0, val1);
     // 3) bilinear interpolation (most of the pixels)
@@ -427,10 +492,10 @@ float get_min_max_subpixel( SVRInfo& svr, Point2d pos, int channel, bool useMin
         int a = (py < svr.patchSize / 2) ? y-1 : y;  // above neighbor y position
         
         float vals[4];
-        vals[0] = (useMin ? svr.vMin : svr.vMax)[a*numx + l][c];      // top left
-        vals[1] = (useMin ? svr.vMin : svr.vMax)[a*numx + l+1][c];    // topright
-        vals[2] = (useMin ? svr.vMin : svr.vMax)[(a+1)*numx + l][c];  // bottom left
-        vals[3] = (useMin ? svr.vMin : svr.vMax)[(a+1)*numx + l+1][c];// bottom right
+        vals[0] = values[a*numx + l];      // top left
+        vals[1] = values[a*numx + l+1];    // topright
+        vals[2] = values[(a+1)*numx + l];  // bottom left
+        vals[3] = values[(a+1)*numx + l+1];// bottom right
        
         res = interpolate_bilinear(ix, iy,  (double)l*svr.patchSize + svr.patchSize/2.0, 
                                             (double)a*svr.patchSize + svr.patchSize/2.0, 
@@ -470,6 +535,47 @@ double screen_dynamic_range ( Mat& minRadiance, Mat& maxRadiance)
     return range;
 }
 
+//
+// files
+//
+
+/**
+   last modification time of a file (0 if it does not exist)
+*/
+time_t file_mtime (string filename)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) return 0;
+    return st.st_mtime;
+}
+
+/**
+   mkdir -p
+*/
+bool make_dirs (string path)
+{
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos+1)) {
+        string dir = path.substr(0, pos);
+        if (not dir.empty() && mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        if (pos == string::npos) break;
+    }
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+   64 bit FNV-1a hash of a string
+*/
+unsigned long long hash_string (const string& str)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (uint i=0; i<str.size(); i++) {
+        h ^= (unsigned char) str[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
 //
 // remote camera control
 //
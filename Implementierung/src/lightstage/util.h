@@ -12,6 +12,10 @@
 #include <thread>         // std::this_thread::sleep_for
 #include <chrono>
 #include <time.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "svrfile.h"
 
 
 
@@ -59,6 +63,15 @@ inline double elapsed_ms (timespec& ts, timespec& te)
 { 
     return  (double)te.tv_nsec/1e6 + (double)te.tv_sec*1e3 - ((double)ts.tv_nsec/1e6 + (double)ts.tv_sec*1e3 );
 }
+// timestamp shifted by ms milliseconds
+inline timespec add_ms (timespec t, double ms)
+{
+    long long ns = (long long)t.tv_sec * 1000000000LL + t.tv_nsec + (long long)(ms * 1e6);
+    t.tv_sec = ns / 1000000000LL;
+    t.tv_nsec = ns % 1000000000LL;
+    return t;
+}
+
 extern timespec tstart, tend;
 inline void sw_start() { clock(tstart); }
 inline void sw_stop()   { clock(tend); }
@@ -155,12 +168,20 @@ float interpolate_linear (float p, float p1, float p2, float val1, float val2);
 typedef Size_<double> Size2d;
 
 // bundles all SV response curve - related information (some are redundant)
+// The per patch data is stored as one contiguous float array per quantity, split by channel:
+// vMin, vMax and invRange as [channel][patch], the inverted response curves as [channel][patch][lutIndex].
+// The arrays are either allocated (aligned by OpenCV) or point into a memory-mapped SVR file.
 class SVRInfo {
   public:
+    SVRInfo () : size(0), lutSize(0), exposure(0), patchSize(0) {}
+    
     int size;                           // number of patches
-    vector<vector<Vec3f> > response;    // response curve of all patches
-    vector<Vec3f> vMin;                 // minimal rel. radiance of the patches
-    vector<Vec3f> vMax;                 // maximum rel. radiance of the patches
+    int lutSize;                        // number of entries per response curve
+    Mat response;                       // inverted response curves: 3*size rows with lutSize floats
+    Mat vMin;                           // minimal rel. radiance of the patches: 3 rows with size floats
+    Mat vMax;                           // maximum rel. radiance of the patches: 3 rows with size floats
+    Mat invRange;                       // 1 / (vMax - vMin); 0 if the range is empty
+    Ptr<SVRFile> file;                  // mapped SVR file the arrays point to (if loaded from a binary file)
     double exposure;                    // exposure time used for calibration (for relating the relative radiance values)
     Size2d screenSize;                  // native screen size
     Size2d borderSize;                  // border size in pixels (vertical, horizontal)
@@ -186,6 +207,38 @@ class SVRInfo {
         return true;
     }    
     
+    // span accessors: pointer to the response curve (lutSize entries) of one patch
+    // and to the per patch values (size entries) of one channel
+    const float* curve (int channel, int patch) const { return response.ptr<float>(channel*size + patch); }
+    const float* minValues (int channel) const { return vMin.ptr<float>(channel); }
+    const float* maxValues (int channel) const { return vMax.ptr<float>(channel); }
+    const float* invRanges (int channel) const { return invRange.ptr<float>(channel); }
+    
+    // allocate the arrays for _size patches with curves of _lutSize entries; call updateRanges() after filling them
+    void allocate (int _size, int _lutSize)
+    {
+        size = _size;
+        lutSize = _lutSize;
+        response.create (3*size, lutSize, CV_32F);
+        vMin.create (3, size, CV_32F);
+        vMax.create (3, size, CV_32F);
+        file.release();
+    }
+    
+    // recalculate the reciprocal ranges from vMin and vMax
+    void updateRanges ()
+    {
+        invRange.create (3, size, CV_32F);
+        for (int c=0; c<3; c++) {
+            const float* lo = minValues(c);
+            const float* hi = maxValues(c);
+            float* inv = invRange.ptr<float>(c);
+            for (int p=0; p<size; p++) {
+                inv[p] = (hi[p] > lo[p]) ? 1.0f / (hi[p] - lo[p]) : 0;
+            }
+        }
+    }
+    
     // rescale so we can reduce the virtual display size; crop border
     void rescale(double scale)
     {
@@ -197,6 +250,10 @@ class SVRInfo {
     }
 };
 
+// load SVR data for a display configuration: from the binary SVR file given by the key svrFile (memory-mapped),
+// or from the min_N / max_N / response_N keys of the configuration itself
+bool load_svr (FileStorage& fs, SVRInfo& svr);
+
 
 // linear scale value val, so that minVal is mapped to 0.0 and maxVal is mapped to 1.0
 float fit_in_range (float val, float minVal, float maxVal);
@@ -228,6 +285,19 @@ void get_min_max_screen ( Mat& img, SVRInfo& svr, bool useMin );
 // calculate dynamic range via min/max screen radiance
 double screen_dynamic_range ( Mat& minRadiance, Mat& maxRadiance );
 
+//
+// files
+//
+
+// last modification time of a file (0 if it does not exist)
+time_t file_mtime (string filename);
+
+// create a directory and all missing parent directories; false if it cannot be created
+bool make_dirs (string path);
+
+// 64 bit FNV-1a hash of a string (e.g. for cache file names)
+unsigned long long hash_string (const string& str);
+
 //
 // remote camera control
 //
@@ -105,46 +105,10 @@ int run_hdr_sequence (int argc, char *argv[])
     
     // load SVR data
     SVRInfo svr; 
-    
-    // assert that response type is SVR
-    string type;
-    fs["type"] >> type;
-    assert (strcasecmp(type.c_str(), "svr") == 0);
-                     
-    fs["borderSize"] >> svr.borderSize;         // width/height of vertical/horizontal border
-    fs["screenSize"] >> svr.screenSize;         // screen size in pixels
-    //fs["colorTransform"] >> svr.colorTransMat;  // color transformation matrix
-    fs["patchLayout"] >> svr.patchLayout;       // number of patches in x / y direction
-    fs["patchSize"] >> svr.patchSize;           // size of one square patch
-    
-    // check if patch layout and definitions are consistent
-    if (not svr.checkValues()) {
+    if (not load_svr (fs, svr)) {
         fs.release();
         return -1;
     }
-
-    // load response curves
-    svr.size = svr.patchLayout.width * svr.patchLayout.height;
-    svr.vMin.resize(svr.size);
-    svr.vMax.resize(svr.size);
-    svr.response.resize(svr.size);
-    
-    for (int n=0; n<svr.size; n++) {
-        stringstream ss;
-        ss << "min_" << n;
-        fs[ss.str().c_str()] >> svr.vMin[n];
-        
-        ss.str(string());
-        ss << "max_" << n;
-        fs[ss.str().c_str()] >> svr.vMax[n];
-        
-        ss.str(string());
-        ss << "response_" << n;
-        fs[ss.str().c_str()] >> svr.response[n];
-        
-        // stdout progress dots
-        if (n % (svr.size/10) == 0) cout << "." << flush;
-    }
     
     fs.release();
     cout << " done!" << endl;
@@ -0,0 +1 @@
+../lightstage/svrfile.cpp
\ No newline at end of file
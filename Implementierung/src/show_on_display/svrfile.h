@@ -0,0 +1 @@
+../lightstage/svrfile.h
\ No newline at end of file
@@ -0,0 +1 @@
+../lightstage/framesource.cpp
\ No newline at end of file
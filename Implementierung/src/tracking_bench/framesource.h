@@ -0,0 +1 @@
+../lightstage/framesource.h
\ No newline at end of file
@@ -0,0 +1 @@
+../lightstage/tracking.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../lightstage/tracking.h
\ No newline at end of file
@@ -0,0 +1,182 @@
+/**
+  tracking_bench - replays a tracking recording (lightstage with trackingRecord: 1) through the tracking
+  and reports detection latency, pose rate, dropped frames and the pose differences to the recorded run.
+
+  @author Manuel Jerger <nom@nomnom.de>
+*/
+
+#include "tracking_bench.h"
+
+using namespace std;
+using namespace cv;
+
+const char* PROGNAME = "tracking_bench";
+
+/**
+ Prints usage.
+*/
+void help()
+{
+    cout << "Replays a tracking recording through the marker tracking and compares the poses with the recorded run.\n" <<
+        "Usage: \n" <<
+        " " << PROGNAME << " <recording> <cam_params.yml> <lightstage_params.yml> [ realtime | fast ] [ poses.log ]" << endl <<
+        "     <recording>               Directory written by lightstage with trackingRecord: 1" << endl <<
+        "     <cam_params.yml>          Camera Matrix and Distortion coefficients (from calibrate_camera)" << endl <<
+        "     <lightstage_params.yml>   Light stage configuration file (tracking parameters are used)" << endl <<
+        "     [ realtime | fast ]       Replay with the recorded frame rate or as fast as possible, without dropping frames (default)" << endl <<
+        "     [ poses.log ]             Output file for the poses of the replay (default: <recording>/replay_poses.log)" << endl << endl;
+}
+
+
+// value at fraction p of the sorted values
+static double percentile (vector<double> values, double p)
+{
+    if (values.empty()) return 0;
+    sort (values.begin(), values.end());
+    return values[(size_t)(p * (values.size()-1))];
+}
+
+static double mean (const vector<double>& values)
+{
+    if (values.empty()) return 0;
+    double sum = 0;
+    for (uint i=0; i<values.size(); i++) sum += values[i];
+    return sum / values.size();
+}
+
+static void print_distribution (string name, const vector<double>& values, string unit)
+{
+    cout << "  " << name << ": mean= " << mean(values) << " p50= " << percentile(values, 0.5) << " p90= " << percentile(values, 0.9)
+         << " p99= " << percentile(values, 0.99) << " max= " << percentile(values, 1.0) << " " << unit << endl;
+}
+
+
+/**
+  replay the recording and print the report
+*/
+int run_bench (int argc, char *argv[])
+{
+    string recordDir = argv[1];
+    string camParamsFile = argv[2];
+    string lightstageParamsFile = argv[3];
+    bool realtime = (argc > 4 && strcasecmp(argv[4], "realtime") == 0);
+    string poseLogFile = (argc > 5) ? argv[5] : recordDir + "/replay_poses.log";
+
+    // tracking parameters, same keys and defaults as lightstage
+    FileStorage fs(lightstageParamsFile, FileStorage::READ);
+    if (! fs.isOpened()) {
+        cout << "Error: cannot open " << lightstageParamsFile << endl;
+        return -1;
+    }
+    string markerConfigFile;           fs["markerConfigFile"] >> markerConfigFile;
+    int trackingThreshold;             fs["trackingThreshold"] >> trackingThreshold;
+    bool trackingUseInverted;          fs["trackingUseInverted"] >> trackingUseInverted;
+    bool trackingUseColor;             fs["trackingUseColor"] >> trackingUseColor;
+    bool trackingUndistortPoints=false; fs["trackingUndistortPoints"] >> trackingUndistortPoints;
+    bool trackingROI=false;            fs["trackingROI"] >> trackingROI;
+    int trackingROIFullSearch=30;      fs["trackingROIFullSearch"] >> trackingROIFullSearch;
+    bool trackingAutoThreshold=false;  fs["trackingAutoThreshold"] >> trackingAutoThreshold;
+    int trackingAutoThresholdInterval=15; fs["trackingAutoThresholdInterval"] >> trackingAutoThresholdInterval;
+    int trackingPyramidLevel=0;        fs["trackingPyramidLevel"] >> trackingPyramidLevel;
+    Size2i trackingResolution;         fs["trackingResolution"] >> trackingResolution;
+    fs.release();
+
+    // replay
+    FrameSource source;
+    if (! source.openReplay(recordDir, realtime)) return -1;
+    if (! source.startPoseLog(poseLogFile)) return -1;
+
+    Tracking tracking (source, camParamsFile, markerConfigFile, trackingThreshold, !trackingUseColor, trackingUseInverted, trackingUndistortPoints, trackingResolution);
+    if (not tracking.isOpened()) {
+        cout << "Error: cannot initialize the tracking" << endl;
+        return -1;
+    }
+    tracking.setDebug(false);
+    tracking.setROISearch(trackingROI, trackingROIFullSearch);
+    tracking.setAutoThreshold(trackingAutoThreshold, trackingAutoThresholdInterval);
+    tracking.setPyramidLevel(trackingPyramidLevel);
+
+    cout << "replaying " << recordDir << (realtime ? " with the recorded frame rate" : " as fast as possible") << " ..." << endl;
+    timespec tbegin, tend;
+    clock(tbegin);
+    tracking.start();
+    while (not tracking.finished()) sleep(0.01);
+    clock(tend);
+    tracking.stop();
+
+    unsigned long numFrames = source.framesRead();
+    source.release();  // flushes the pose log
+
+    // poses of the replay and of the recorded run
+    vector<FramePose> replayed, recorded;
+    read_pose_log (poseLogFile, replayed);
+    bool haveRecorded = read_pose_log (recordDir + "/" + POSE_RECORD_FILE, recorded);
+
+    double seconds = elapsed_ms(tbegin, tend) / 1000.0;
+    vector<double> latency;
+    for (uint i=0; i<replayed.size(); i++) latency.push_back(replayed[i].latency);
+
+    cout << endl << "replay: " << numFrames << " frames, " << replayed.size() << " poses in " << seconds << " s" << endl;
+    cout << "  pose rate: " << replayed.size() / seconds << " poses/s, frame rate: " << numFrames / seconds << " frames/s" << endl;
+    cout << "  dropped frames: " << (replayed.empty() ? 0 : replayed.back().droppedFrames) << endl;
+    print_distribution ("detection latency", latency, "ms");
+
+    // compare the poses of the same frames. The recorded run detected on full resolution during the HDR sequences
+    // (setFullResolution), the replay always on trackingPyramidLevel: only frames detected on the same level are compared.
+    if (haveRecorded) {
+        map<unsigned long, const FramePose*> byIndex;
+        for (uint i=0; i<recorded.size(); i++) byIndex[recorded[i].index] = &recorded[i];
+
+        vector<double> posDelta, angleDelta;
+        unsigned long sameFrames = 0;
+        for (uint i=0; i<replayed.size(); i++) {
+            map<unsigned long, const FramePose*>::iterator it = byIndex.find(replayed[i].index);
+            if (it == byIndex.end()) continue;
+            sameFrames++;
+            const FramePose& a = *it->second;
+            const FramePose& b = replayed[i];
+            if (a.level != b.level) continue;
+
+            posDelta.push_back (norm (a.camPos - b.camPos));
+
+            // rotation between the two camera orientations
+            Matx33d ra, rb;
+            Rodrigues (a.rotVec, ra);
+            Rodrigues (b.rotVec, rb);
+            Matx31d dr;
+            Rodrigues (ra.t() * rb, dr);
+            angleDelta.push_back (norm(dr) / M_PI * 180.0);
+        }
+
+        cout << "recorded run: " << recorded.size() << " poses" << endl;
+        cout << "  same frames: " << sameFrames << ", only recorded: " << recorded.size() - sameFrames
+             << ", only replayed: " << replayed.size() - sameFrames << endl;
+        cout << "  compared (same detection level): " << posDelta.size() << ", other level: " << sameFrames - posDelta.size() << endl;
+        print_distribution ("position delta", posDelta, "mm");
+        print_distribution ("rotation delta", angleDelta, "degree");
+    }
+
+    cout << "replay poses written to " << poseLogFile << endl;
+    return 0;
+}
+
+
+/**
+  Main: calls run_bench
+*/
+int main(int argc, char *argv[])
+{
+    cout << PROGNAME << " started" << endl;
+
+    int ret = 0;
+
+    if (argc < 4) {
+        help();
+        ret = -1;
+    } else {
+        ret = run_bench( argc, argv );
+    }
+
+    cout << PROGNAME << " finished" << endl;
+    return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef TRACKING_BENCH_H
+#define TRACKING_BENCH_H
+
+#include <opencv2/core/core.hpp>        // Basic OpenCV structures (cv::Mat, Scalar)
+#include <opencv2/imgproc/imgproc.hpp>  // Image Processing
+#include <opencv2/calib3d/calib3d.hpp>  // Rodrigues
+
+#include <iostream>
+#include <string.h>
+#include <map>
+#include <algorithm>
+
+#include "util.h"
+#include "framesource.h"
+#include "tracking.h"
+
+
+/**
+  replay a recording through the tracking and print the benchmark report
+*/
+int run_bench (int argc, char *argv[]);
+
+#endif //  TRACKING_BENCH_H
@@ -0,0 +1 @@
+../lightstage/util.cpp
\ No newline at end of file
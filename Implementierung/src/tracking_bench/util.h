@@ -0,0 +1 @@
+../lightstage/util.h
\ No newline at end of file